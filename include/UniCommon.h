@@ -18,12 +18,22 @@
 #define _UNI_COMMON_H
 
 #include "Utils/ApplicationTimer.hpp"
+#include "Utils/UniHistogram.hpp"
 #include "Utils/ArrayPtr.hpp"
+#include "Utils/UniAtomic.hpp"
 #include "Utils/UniFile.h"
+#include "Utils/UniFileChunks.hpp"
+#include "Utils/UniLiveSettings.hpp"
 #include "Utils/UniMutex.hpp"
 #include "Utils/UniThread.hpp"
+#include "Utils/UniThreadPool.hpp"
+#include "Utils/UniTaskScheduler.hpp"
+#include "Utils/UniQueue.hpp"
+#include "Utils/UniProfiler.hpp"
 #include "Utils/UniSettings.h"
+#include "Utils/UniSettingsSchema.hpp"
 #include "Utils/UniTimer.h"
+#include "Utils/UniUtf8.h"
 
 #endif
 
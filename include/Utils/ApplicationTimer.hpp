@@ -18,14 +18,21 @@
 #define _APPLICATION_TIMER_H
 
 #include <algorithm>
+#include <stdint.h>
 #if defined(_WIN32)
 #ifndef WIN32_LEAN_AND_MEAN
 #define WIN32_LEAN_AND_MEAN
 #endif
 #include <windows.h>
+#include <intrin.h>
 #else
 #include <unistd.h>
+#include <time.h>
 #endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#include "UniHistogram.hpp"
 
 namespace utils {
 
@@ -38,12 +45,121 @@ void sleep(T miliseconds) {
 #endif
 }
 
-enum TimerType { CPU_TIMER = 0, REAL_TIMER = 1 };
+//TSC_TIMER counts CPU timestamp ticks (cntvct on ARM64), a few ns per reading;
+//they are converted to seconds only when reported. The TSC has to be invariant,
+//as on every x86 CPU of the last decade.
+enum TimerType { CPU_TIMER = 0, REAL_TIMER = 1, TSC_TIMER = 2 };
 
 namespace timer_detail {
 
+//Raw timestamp counter with its frequency
+struct Tsc {
+    static uint64_t ticks() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_lfence();
+        uint64_t t = __rdtsc();
+        _mm_lfence();
+        return t;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        //lfence keeps rdtsc from moving into or out of the timed section
+        _mm_lfence();
+        uint64_t t = __rdtsc();
+        _mm_lfence();
+        return t;
+#elif defined(__GNUC__) && defined(__aarch64__)
+        uint64_t t;
+        __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(t) :: "memory");
+        return t;
+#elif defined(_WIN32)
+        LARGE_INTEGER query_ticks;
+        QueryPerformanceCounter(&query_ticks);
+        return static_cast<uint64_t>(query_ticks.QuadPart);
+#else
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+#endif
+    }
+
+    //Same counter without the ordering, for timestamps rather than short intervals
+    static uint64_t stamp() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        return __rdtsc();
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        return __rdtsc();
+#elif defined(__GNUC__) && defined(__aarch64__)
+        uint64_t t;
+        __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+        return t;
+#else
+        return ticks();
+#endif
+    }
+
+    //Calibrated on first use, ApplicationTimer<TSC_TIMER> does it in its constructor
+    static double secondsPerTick() {
+        static const double value = calibrate();
+        return value;
+    }
+
+private:
+    static double calibrate() {
+#if defined(__GNUC__) && defined(__aarch64__)
+        uint64_t freq;
+        __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+        return 1.0 / double(freq);
+#elif defined(_WIN32) && !(defined(_M_X64) || defined(_M_IX86))
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        return 1.0 / double(freq.QuadPart);
+#elif (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))) || defined(_MSC_VER)
+        //Against the system monotonic clock over ~20 ms, the TSC reading taken
+        //between two clock readings
+        double clock0 = monotonic();
+        uint64_t tsc0 = ticks();
+        double clock1 = monotonic();
+        utils::sleep(20);
+        double clock2 = monotonic();
+        uint64_t tsc1 = ticks();
+        double clock3 = monotonic();
+        return ((clock2 + clock3) - (clock0 + clock1)) / 2 / double(tsc1 - tsc0);
+#else
+        return 1e-9;
+#endif
+    }
+
+    static double monotonic() {
+#if defined(_WIN32)
+        LARGE_INTEGER query_ticks, freq;
+        QueryPerformanceCounter(&query_ticks);
+        QueryPerformanceFrequency(&freq);
+        return double(query_ticks.QuadPart) / double(freq.QuadPart);
+#else
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return double(ts.tv_sec) + 1e-9 * double(ts.tv_nsec);
+#endif
+    }
+};
+
 template<int TYPE = utils::CPU_TIMER>
 struct InternalImp {
+    typedef double tick_type;
+    static tick_type maximum() {
+        return 1e9;
+    }
+    static double seconds(tick_type ticks, const double freq) {
+        (void)freq;
+        return ticks;
+    }
+    //Histogram samples are nanoseconds
+    static uint64_t sample(tick_type ticks) {
+        return ticks > 0 ? static_cast<uint64_t>(ticks * 1e9 + 0.5) : 0;
+    }
+    static double sampleSeconds(double sample, const double freq) {
+        (void)freq;
+        return sample * 1e-9;
+    }
     static double getTime(const double freq)  {
 #if defined(_WIN32)
         LARGE_INTEGER query_ticks;
@@ -60,12 +176,29 @@ struct InternalImp {
 
 template<>
 struct InternalImp<utils::REAL_TIMER> {
+    typedef double tick_type;
+    static tick_type maximum() {
+        return 1e9;
+    }
+    static double seconds(tick_type ticks, const double freq) {
+        (void)freq;
+        return ticks;
+    }
+    static uint64_t sample(tick_type ticks) {
+        return InternalImp<utils::CPU_TIMER>::sample(ticks);
+    }
+    static double sampleSeconds(double sample, const double freq) {
+        return InternalImp<utils::CPU_TIMER>::sampleSeconds(sample, freq);
+    }
+    //Seconds since the Unix epoch
     static double getTime(const double freq) {
         (void)freq;
 #if defined(_WIN32)
-        SYSTEMTIME st;
-        GetSystemTime(&st);
-        return (double)st.wSecond + 1.e-3 * (double)st.wMilliseconds;
+        //100 ns units since 1601
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft);
+        uint64_t t = (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+        return double(t) * 1e-7 - 11644473600.0;
 #elif defined(__linux__)
         timespec ts;
         clock_gettime(CLOCK_REALTIME, &ts);
@@ -74,18 +207,73 @@ struct InternalImp<utils::REAL_TIMER> {
     }
 };
 
+template<>
+struct InternalImp<utils::TSC_TIMER> {
+    typedef uint64_t tick_type;
+    static tick_type maximum() {
+        return ~static_cast<uint64_t>(0);
+    }
+    static double seconds(tick_type ticks, const double freq) {
+        (void)freq;
+        return double(ticks) * Tsc::secondsPerTick();
+    }
+    //Histogram samples are the raw ticks
+    static uint64_t sample(tick_type ticks) {
+        return ticks;
+    }
+    static double sampleSeconds(double sample, const double freq) {
+        (void)freq;
+        return sample * Tsc::secondsPerTick();
+    }
+    static tick_type getTime(const double freq) {
+        (void)freq;
+        return Tsc::ticks();
+    }
+};
+
 }//namespace timer_detail
 
+//Latency distribution of an ApplicationTimer, in seconds
+struct TimerSummary {
+    uint64_t count;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+    double max;
+};
+
 
 template<int TYPE>
 class ApplicationTimer {
+    typedef timer_detail::InternalImp<TYPE> Imp;
 
+public:
+    //double seconds, raw ticks for TSC_TIMER
+    typedef typename Imp::tick_type tick_type;
+
+private:
     template<int TT>
-    double getTime() const {
+    tick_type getTime() const {
 #if defined(_WIN32)
         return timer_detail::InternalImp<TT>::getTime(mFrequency);
 #else
         return timer_detail::InternalImp<TT>::getTime(0.0);
+#endif
+    }
+    double seconds(tick_type ticks) const {
+#if defined(_WIN32)
+        return Imp::seconds(ticks, mFrequency);
+#else
+        return Imp::seconds(ticks, 0.0);
+#endif
+    }
+    double sampleSeconds(double sample) const {
+#if defined(_WIN32)
+        return Imp::sampleSeconds(sample, mFrequency);
+#else
+        return Imp::sampleSeconds(sample, 0.0);
 #endif
     }
 
@@ -96,13 +284,22 @@ public:
         QueryPerformanceFrequency(&freq);
         mFrequency = (double)freq.QuadPart;
 #endif
+        //Calibrates the TSC now rather than in the first timed section
+        seconds(0);
+        mStarts = mTimes = 0;
+        mRecording = false;
         reset();
     }
     ~ApplicationTimer() {}
 
     void reset() {
-        mBests = (1e9);
+        mBests = Imp::maximum();
         mTotals = 0;
+        mHistogram.reset();
+    }
+    //Opt-in: every stop() also goes into a histogram, for percentile() and summary()
+    void recordHistogram(bool enable = true) {
+        mRecording = enable;
     }
     void start() {
         mStarts = getTime<TYPE>();
@@ -112,28 +309,68 @@ public:
         mTimes = getTime<TYPE>() - mStarts;
         mBests = min(mBests,mTimes);
         mTotals += mTimes;
+        if(mRecording)
+            mHistogram.record(Imp::sample(mTimes));
+    }
+    //Adds the measurements of other, e.g. the same section timed in another thread
+    void merge(const ApplicationTimer &other) {
+        using namespace std;
+        mBests = min(mBests,other.mBests);
+        mTotals += other.mTotals;
+        mHistogram.merge(other.mHistogram);
     }
     double relative() const {
-        return getTime<TYPE>() - mStarts;
+        return seconds(getTime<TYPE>() - mStarts);
     }
     double value() const {
-        return mTimes;
+        return seconds(mTimes);
     }
     double best() const {
-        return mBests;
+        return seconds(mBests);
     }
     double total() const {
+        return seconds(mTotals);
+    }
+    //Unconverted measurements
+    tick_type valueTicks() const {
+        return mTimes;
+    }
+    tick_type bestTicks() const {
+        return mBests;
+    }
+    tick_type totalTicks() const {
         return mTotals;
     }
+    //Seconds, from the recorded histogram
+    double percentile(double percent) const {
+        return sampleSeconds(double(mHistogram.percentile(percent)));
+    }
+    TimerSummary summary() const {
+        TimerSummary result;
+        result.count = mHistogram.count();
+        result.mean = sampleSeconds(mHistogram.mean());
+        result.p50 = percentile(50.0);
+        result.p90 = percentile(90.0);
+        result.p99 = percentile(99.0);
+        result.p999 = percentile(99.9);
+        result.max = sampleSeconds(double(mHistogram.maximum()));
+        return result;
+    }
+    //Samples in ns, raw ticks for TSC_TIMER
+    const UniHistogram &histogram() const {
+        return mHistogram;
+    }
 
 private:
 #if defined(_WIN32)
     double mFrequency;
 #endif
-    double mStarts;
-    double mTimes;
-    double mBests;
-    double mTotals;
+    tick_type mStarts;
+    tick_type mTimes;
+    tick_type mBests;
+    tick_type mTotals;
+    bool mRecording;
+    UniHistogram mHistogram;
 
 };
 
@@ -13,6 +13,7 @@ extern "C" {
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdlib.h>
 
 /* Nonzero to allow multi-line value parsing, in the style of Python's
    ConfigParser. If allowed, ini_parse() will call the handler with the same
@@ -37,10 +38,6 @@ extern "C" {
 #define INI_MAX_LINE 200
 #endif
 
-#if !INI_USE_STACK
-#include <stdlib.h>
-#endif
-
 #define MAX_SECTION 50
 #define MAX_NAME 50
 
@@ -48,6 +45,13 @@ extern "C" {
 }
 #endif
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace utils {
 namespace priv {
 
@@ -211,6 +215,182 @@ int ini_parse(const char* filename,
     return error;
 }
 
+/* Handler of ini_parse_buffer. The strings point into the parsed buffer and
+   are not null terminated. */
+typedef int (*ini_view_handler)(void* user, const char* section, size_t section_len,
+                                const char* name, size_t name_len,
+                                const char* value, size_t value_len);
+
+/* Ranged versions of rstrip, lskip and find_char_or_comment, for text which
+   is not null terminated */
+static const char* rstrip_n(const char* s, const char* end)
+{
+    while (end > s && isspace((unsigned char)end[-1]))
+        end--;
+    return end;
+}
+
+static const char* lskip_n(const char* s, const char* end)
+{
+    while (s < end && isspace((unsigned char)(*s)))
+        s++;
+    return s;
+}
+
+/* c of 0 looks only for a comment. Both searches use memchr. */
+static const char* find_char_or_comment_n(const char* s, const char* end, char c)
+{
+    const char* found = c ? (const char*)memchr(s, c, end - s) : NULL;
+    const char* limit = found ? found : end;
+    const char* p = s + 1;
+    while (p < limit) {
+        const char* semi = (const char*)memchr(p, ';', limit - p);
+        if (!semi)
+            break;
+        if (isspace((unsigned char)semi[-1]))
+            return semi;
+        p = semi + 1;
+    }
+    return limit;
+}
+
+static
+/* Parses INI text held in memory, same rules as ini_parse_file but without
+   any line or name length limits. Nothing is copied, the handler gets views
+   into data. Returns the same codes as ini_parse_file. */
+int ini_parse_buffer(const char* data, size_t size, ini_view_handler handler, void* user)
+{
+    const char* cur = data;
+    const char* last = data + size;
+    const char* section = "";
+    size_t section_len = 0;
+    const char* prev_name = NULL;
+    size_t prev_name_len = 0;
+    int lineno = 0;
+    int error = 0;
+
+    while (cur < last) {
+        const char* line = cur;
+        const char* eol = (const char*)memchr(cur, '\n', last - cur);
+        cur = eol ? eol + 1 : last;
+        if (!eol)
+            eol = last;
+        lineno++;
+
+        const char* start = line;
+#if INI_ALLOW_BOM
+        if (lineno == 1 && eol - start >= 3 &&
+                           (unsigned char)start[0] == 0xEF &&
+                           (unsigned char)start[1] == 0xBB &&
+                           (unsigned char)start[2] == 0xBF) {
+            start += 3;
+            line = start;
+        }
+#endif
+        const char* end = rstrip_n(start, eol);
+        start = lskip_n(start, end);
+
+        if (start < end && (*start == ';' || *start == '#')) {
+            /* Per Python ConfigParser, allow '#' comments at start of line */
+        }
+#if INI_ALLOW_MULTILINE
+        else if (prev_name_len && start < end && start > line) {
+            /* Non-black line with leading whitespace, treat as continuation
+               of previous name's value (as per Python ConfigParser). */
+            if (!handler(user, section, section_len, prev_name, prev_name_len,
+                         start, end - start) && !error)
+                error = lineno;
+        }
+#endif
+        else if (start < end && *start == '[') {
+            /* A "[section]" line */
+            const char* close = find_char_or_comment_n(start + 1, end, ']');
+            if (close < end && *close == ']') {
+                section = start + 1;
+                section_len = close - section;
+                prev_name_len = 0;
+            }
+            else if (!error) {
+                /* No ']' found on section line */
+                error = lineno;
+            }
+        }
+        else if (start < end) {
+            /* Not a comment, must be a name[=:]value pair */
+            const char* sep = find_char_or_comment_n(start, end, '=');
+            if (sep == end || *sep != '=')
+                sep = find_char_or_comment_n(start, end, ':');
+            if (sep < end && (*sep == '=' || *sep == ':')) {
+                const char* name_end = rstrip_n(start, sep);
+                const char* value = lskip_n(sep + 1, end);
+                const char* value_end = find_char_or_comment_n(value, end, 0);
+                value_end = rstrip_n(value, value_end);
+
+                /* Valid name[=:]value pair found, call handler */
+                prev_name = start;
+                prev_name_len = name_end - start;
+                if (!handler(user, section, section_len, prev_name, prev_name_len,
+                             value, value_end - value) && !error)
+                    error = lineno;
+            }
+            else if (!error) {
+                /* No '=' or ':' found on name[=:]value line */
+                error = lineno;
+            }
+        }
+    }
+
+    return error;
+}
+
+static
+/* Maps the file (reads it where mmap is not available) and parses it with
+   ini_parse_buffer. Return -1 if file could not be opened, -2 on allocation
+   error. */
+int ini_parse_view(const char* filename, ini_view_handler handler, void* user)
+{
+    int error;
+#if defined(__linux__)
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -2;
+    madvise(data, size, MADV_SEQUENTIAL);
+    error = ini_parse_buffer((const char*)data, size, handler, user);
+    munmap(data, size);
+#else
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = (char*)malloc(size > 0 ? size : 1);
+    if (!data) {
+        fclose(file);
+        return -2;
+    }
+    size = (long)fread(data, 1, size > 0 ? size : 0, file);
+    fclose(file);
+    error = ini_parse_buffer(data, size, handler, user);
+    free(data);
+#endif
+    return error;
+}
+
 };
 
 }//namespace priv
@@ -0,0 +1,481 @@
+//CSettingsStore module - key/value index of UniSettings
+/*
+Module Is released under the New BSD license (see LICENSE.txt).
+Go to the source project home page for more info: http://code.google.com/p/inih/
+*/
+#ifndef _CSETTINGS_STORE_H
+#define _CSETTINGS_STORE_H
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <tr1/memory>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <memory>
+#endif
+
+namespace utils {
+namespace priv {
+
+/* Read-only file contents, mapped where mmap is available */
+class CMappedFile {
+
+public:
+CMappedFile() : _data(NULL), _size(0) {}
+
+~CMappedFile() {
+#ifdef __linux__
+    if (_data)
+        munmap(const_cast<char*>(_data), _size);
+#endif
+}
+
+bool open(const char* path) {
+#ifdef __linux__
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    _data = (const char*)data;
+    _size = (size_t)st.st_size;
+    return true;
+#else
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    /* 8 byte units keep the 64 bit fields aligned */
+    _copy.resize(size > 0 ? (size + 7) / 8 : 0);
+    if (size > 0 && fread(&_copy[0], 1, size, file) == (size_t)size) {
+        _data = (const char*)&_copy[0];
+        _size = (size_t)size;
+    }
+    fclose(file);
+    return _data != NULL;
+#endif
+}
+
+const char* data() const { return _data; }
+size_t size() const { return _size; }
+
+private:
+CMappedFile(const CMappedFile&);
+CMappedFile& operator=(const CMappedFile&);
+
+private:
+    const char* _data;
+    size_t _size;
+#ifndef __linux__
+    std::vector<int64_t> _copy;
+#endif
+};
+
+/* Case-insensitive open addressing hash index of "section.name" keys. Keys and
+   values live in one string pool, keys lowercased and values null terminated,
+   so lookups by (pointer, length) do not allocate. The index can be saved as a
+   binary image and used straight from the mapped file. */
+class CSettingsStore {
+
+public:
+struct Entry {
+    uint32_t hash;
+    uint32_t keyOff;
+    uint32_t keyLen;
+    uint32_t valOff;
+    uint32_t valLen;
+    /* Typed forms of the value, see the TYPED_ flags */
+    uint32_t typed;
+    int64_t integer;
+};
+
+enum { TYPED_INTEGER = 1, TYPED_TRUE = 2, TYPED_FALSE = 4 };
+
+static const uint32_t npos = 0xFFFFFFFFu;
+
+/* Binary image layout: header, entries, slots, pool. Written in native byte
+   order, images from another platform fail the header check. */
+struct ImageHeader {
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t entrySize;
+    uint32_t entryCount;
+    uint32_t slotCount;
+    uint32_t poolSize;
+    int32_t error;
+    /* Size and modification time (ns) of the INI file the image was built from */
+    int64_t sourceSize;
+    int64_t sourceTime;
+};
+
+CSettingsStore() : _e(NULL), _s(NULL), _p(NULL), _entryCount(0), _slotCount(0), _poolSize(0) {}
+
+CSettingsStore(const CSettingsStore& other)
+    : _entries(other._entries), _slots(other._slots), _pool(other._pool), _image(other._image) {
+    if (_image) {
+        _e = other._e;
+        _s = other._s;
+        _p = other._p;
+        _entryCount = other._entryCount;
+        _slotCount = other._slotCount;
+        _poolSize = other._poolSize;
+    }
+    else {
+        sync();
+    }
+}
+
+CSettingsStore& operator=(const CSettingsStore& other) {
+    CSettingsStore copy(other);
+    swap(copy);
+    return *this;
+}
+
+static char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+/* FNV-1a of the lowercased key, section and name joined with '.' */
+static uint32_t hashPart(uint32_t h, const char* s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= static_cast<unsigned char>(lower(s[i]));
+        h *= 16777619u;
+    }
+    return h;
+}
+static uint32_t hash(const char* section, size_t sectionLen, const char* name, size_t nameLen) {
+    uint32_t h = hashPart(2166136261u, section, sectionLen);
+    h = hashPart(h, ".", 1);
+    return hashPart(h, name, nameLen);
+}
+
+/* Index of the entry or npos */
+uint32_t find(const char* section, size_t sectionLen, const char* name, size_t nameLen) const {
+    return find(hash(section, sectionLen, name, nameLen), section, sectionLen, name, nameLen);
+}
+uint32_t find(uint32_t h, const char* section, size_t sectionLen, const char* name, size_t nameLen) const {
+    if (_slotCount == 0)
+        return npos;
+    size_t mask = _slotCount - 1;
+    for (size_t i = h & mask; _s[i] != 0; i = (i + 1) & mask) {
+        uint32_t idx = _s[i] - 1;
+        const Entry& e = _e[idx];
+        if (e.hash == h && matches(e, section, sectionLen, name, nameLen))
+            return idx;
+    }
+    return npos;
+}
+
+/* Lookup by the stored form of a key, lowercased "section.name" */
+uint32_t findKey(uint32_t h, const char* key, size_t keyLen) const {
+    if (_slotCount == 0)
+        return npos;
+    size_t mask = _slotCount - 1;
+    for (size_t i = h & mask; _s[i] != 0; i = (i + 1) & mask) {
+        uint32_t idx = _s[i] - 1;
+        const Entry& e = _e[idx];
+        if (e.hash == h && e.keyLen == keyLen && memcmp(_p + e.keyOff, key, keyLen) == 0)
+            return idx;
+    }
+    return npos;
+}
+
+/* Adds the value, or appends it on a new line when the key is already present
+   (multi-line values). Returns the entry index. Not for a loaded image. */
+uint32_t add(const char* section, size_t sectionLen, const char* name, size_t nameLen,
+             const char* value, size_t valueLen) {
+    uint32_t h = hash(section, sectionLen, name, nameLen);
+    uint32_t idx = find(h, section, sectionLen, name, nameLen);
+    if (idx != npos) {
+        Entry& e = _entries[idx];
+        if (e.valLen == 0) {
+            e.valOff = store(value, valueLen, false);
+            e.valLen = static_cast<uint32_t>(valueLen);
+        }
+        else {
+            /* The joined value is written anew at the end of the pool */
+            size_t oldOff = e.valOff, oldLen = e.valLen;
+            size_t off = _pool.size();
+            _pool.resize(off + oldLen + 1 + valueLen + 1);
+            memcpy(&_pool[off], &_pool[oldOff], oldLen);
+            _pool[off + oldLen] = '\n';
+            memcpy(&_pool[off + oldLen + 1], value, valueLen);
+            _pool[off + oldLen + 1 + valueLen] = '\0';
+            e.valOff = static_cast<uint32_t>(off);
+            e.valLen = static_cast<uint32_t>(oldLen + 1 + valueLen);
+        }
+        sync();
+        return idx;
+    }
+
+    Entry e;
+    e.hash = h;
+    e.keyOff = static_cast<uint32_t>(_pool.size());
+    e.keyLen = static_cast<uint32_t>(sectionLen + 1 + nameLen);
+    store(section, sectionLen, true);
+    _pool.back() = '.';
+    store(name, nameLen, true);
+    e.valOff = store(value, valueLen, false);
+    e.valLen = static_cast<uint32_t>(valueLen);
+    e.typed = 0;
+    e.integer = 0;
+    idx = push(e);
+    sync();
+    return idx;
+}
+
+/* Copies the entries of other in its order. Keys already present take the
+   value of other, so merging layers in order lets later ones override. Not
+   for a loaded image. */
+void merge(const CSettingsStore& other) {
+    for (uint32_t i = 0; i < other._entryCount; i++) {
+        const Entry& src = other._e[i];
+        const char* key = other._p + src.keyOff;
+        uint32_t idx = findKey(src.hash, key, src.keyLen);
+        if (idx == npos) {
+            Entry e = src;
+            e.keyOff = store(key, src.keyLen, false);
+            e.valOff = store(other._p + src.valOff, src.valLen, false);
+            push(e);
+        }
+        else {
+            Entry& e = _entries[idx];
+            e.valOff = store(other._p + src.valOff, src.valLen, false);
+            e.valLen = src.valLen;
+            e.typed = src.typed;
+            e.integer = src.integer;
+        }
+        sync();
+    }
+}
+
+size_t size() const { return _entryCount; }
+const Entry& entry(uint32_t idx) const { return _e[idx]; }
+/* Only for a store built in memory, a loaded image is read-only */
+Entry& entry(uint32_t idx) {
+    assert(!mapped());
+    return _entries[idx];
+}
+const char* key(uint32_t idx) const { return _p + _e[idx].keyOff; }
+const char* value(uint32_t idx) const { return _p + _e[idx].valOff; }
+bool mapped() const { return _image.get() != NULL; }
+
+void swap(CSettingsStore& other) {
+    _entries.swap(other._entries);
+    _slots.swap(other._slots);
+    _pool.swap(other._pool);
+    _image.swap(other._image);
+    std::swap(_e, other._e);
+    std::swap(_s, other._s);
+    std::swap(_p, other._p);
+    std::swap(_entryCount, other._entryCount);
+    std::swap(_slotCount, other._slotCount);
+    std::swap(_poolSize, other._poolSize);
+}
+
+/* Size and modification time of a file, false if it does not exist */
+static bool stamp(const char* path, int64_t& size, int64_t& time) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+    size = (int64_t)st.st_size;
+#ifdef __linux__
+    time = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    time = (int64_t)st.st_mtime * 1000000000;
+#endif
+    return true;
+}
+
+/* Writes the image to a temporary file renamed over path, so processes mapping
+   the previous image are not disturbed */
+bool save(const char* path, int error, int64_t sourceSize, int64_t sourceTime) const {
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "UNISETS", 8);
+    header.byteOrder = 0x01020304u;
+    header.entrySize = sizeof(Entry);
+    header.entryCount = _entryCount;
+    header.slotCount = _slotCount;
+    header.poolSize = _poolSize;
+    header.error = error;
+    header.sourceSize = sourceSize;
+    header.sourceTime = sourceTime;
+
+    char suffix[32];
+#ifdef __linux__
+    sprintf(suffix, ".%ld.tmp", (long)getpid());
+#else
+    sprintf(suffix, ".%p.tmp", (const void*)this);
+#endif
+    std::string tmp = std::string(path) + suffix;
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(_e, sizeof(Entry), _entryCount, file) == _entryCount &&
+              fwrite(_s, sizeof(uint32_t), _slotCount, file) == _slotCount &&
+              fwrite(_p, 1, header.poolSize, file) == header.poolSize;
+    ok = (fclose(file) == 0) && ok;
+#ifdef _WIN32
+    if (ok)
+        remove(path);
+#endif
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Uses the image in place when it is valid and was built from a source of the
+   given size and time. Returns false and leaves the store unchanged otherwise. */
+bool load(const char* path, int64_t sourceSize, int64_t sourceTime, int& error) {
+    std::tr1::shared_ptr<CMappedFile> image(new CMappedFile());
+    if (!image->open(path) || image->size() < sizeof(ImageHeader))
+        return false;
+    const ImageHeader* header = (const ImageHeader*)image->data();
+    uint64_t expected = sizeof(ImageHeader) + (uint64_t)header->entryCount * sizeof(Entry) +
+                        (uint64_t)header->slotCount * sizeof(uint32_t) + header->poolSize;
+    if (memcmp(header->magic, "UNISETS", 8) != 0 || header->byteOrder != 0x01020304u ||
+        header->entrySize != sizeof(Entry) || expected != image->size() ||
+        (header->slotCount & (header->slotCount - 1)) != 0 ||
+        header->sourceSize != sourceSize || header->sourceTime != sourceTime)
+        return false;
+    /* Every string and slot has to stay inside the image, and a probe has to
+       reach an empty slot, whatever the file holds */
+    const Entry* entries = (const Entry*)(image->data() + sizeof(ImageHeader));
+    const uint32_t* slots = (const uint32_t*)(entries + header->entryCount);
+    const char* pool = (const char*)(slots + header->slotCount);
+    for (uint32_t i = 0; i < header->entryCount; i++) {
+        const Entry& e = entries[i];
+        if ((uint64_t)e.keyOff + e.keyLen >= header->poolSize || (uint64_t)e.valOff + e.valLen >= header->poolSize ||
+            pool[e.valOff + e.valLen] != '\0')
+            return false;
+    }
+    bool empty = false;
+    for (uint32_t i = 0; i < header->slotCount; i++) {
+        if (slots[i] > header->entryCount)
+            return false;
+        empty = empty || slots[i] == 0;
+    }
+    if (header->slotCount != 0 && !empty)
+        return false;
+
+    CSettingsStore loaded;
+    loaded._image = image;
+    loaded._entryCount = header->entryCount;
+    loaded._slotCount = header->slotCount;
+    loaded._poolSize = header->poolSize;
+    loaded._e = entries;
+    loaded._s = slots;
+    loaded._p = pool;
+    error = header->error;
+    swap(loaded);
+    return true;
+}
+
+private:
+bool matches(const Entry& e, const char* section, size_t sectionLen, const char* name, size_t nameLen) const {
+    if (e.keyLen != sectionLen + 1 + nameLen)
+        return false;
+    const char* k = _p + e.keyOff;
+    for (size_t i = 0; i < sectionLen; i++)
+        if (k[i] != lower(section[i]))
+            return false;
+    if (k[sectionLen] != '.')
+        return false;
+    k += sectionLen + 1;
+    for (size_t i = 0; i < nameLen; i++)
+        if (k[i] != lower(name[i]))
+            return false;
+    return true;
+}
+
+/* Copies the string into the pool followed by a null, returns its offset */
+uint32_t store(const char* s, size_t len, bool lowercase) {
+    size_t off = _pool.size();
+    _pool.resize(off + len + 1);
+    if (lowercase) {
+        for (size_t i = 0; i < len; i++)
+            _pool[off + i] = lower(s[i]);
+    }
+    else if (len) {
+        memcpy(&_pool[off], s, len);
+    }
+    _pool[off + len] = '\0';
+    return static_cast<uint32_t>(off);
+}
+
+uint32_t push(const Entry& e) {
+    _entries.push_back(e);
+    uint32_t idx = static_cast<uint32_t>(_entries.size() - 1);
+    if ((_entries.size() + 1) * 2 > _slots.size())
+        rehash(_slots.empty() ? 16 : _slots.size() * 2);
+    else
+        insert(idx);
+    return idx;
+}
+
+void insert(uint32_t idx) {
+    size_t mask = _slots.size() - 1;
+    size_t i = _entries[idx].hash & mask;
+    while (_slots[i] != 0)
+        i = (i + 1) & mask;
+    _slots[i] = idx + 1;
+}
+
+void rehash(size_t capacity) {
+    _slots.assign(capacity, 0);
+    for (uint32_t i = 0; i < _entries.size(); i++)
+        insert(i);
+}
+
+/* Points the read side at the vectors after they changed */
+void sync() {
+    _e = _entries.empty() ? NULL : &_entries[0];
+    _s = _slots.empty() ? NULL : &_slots[0];
+    _p = _pool.empty() ? NULL : &_pool[0];
+    _entryCount = static_cast<uint32_t>(_entries.size());
+    _slotCount = static_cast<uint32_t>(_slots.size());
+    _poolSize = static_cast<uint32_t>(_pool.size());
+}
+
+private:
+    std::vector<Entry> _entries;
+    /* Entry index + 1, zero marks a free slot */
+    std::vector<uint32_t> _slots;
+    std::vector<char> _pool;
+    /* Mapped image the read side points into, if loaded from one */
+    std::tr1::shared_ptr<CMappedFile> _image;
+    const Entry* _e;
+    const uint32_t* _s;
+    const char* _p;
+    uint32_t _entryCount;
+    uint32_t _slotCount;
+    uint32_t _poolSize;
+};
+
+}//namespace priv
+}//namespace utils
+
+#endif
@@ -0,0 +1,173 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_ATOMIC_HPP
+#define _UNI_ATOMIC_HPP
+
+//Atomic operations on plain integers and pointers, for compilers without <atomic>.
+//load/store/exchange/fetchAdd/compareExchange are sequentially consistent,
+//the Acquire/Release variants are for the hot paths which only need the pairing.
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <string.h>
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+#include <xmmintrin.h>
+#endif
+
+namespace utils {
+
+#if defined(__GNUC__) || defined(__clang__)
+struct UniAtomic {
+    template<typename T>
+    static T load(const volatile T *p) {
+        return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+    }
+    template<typename T>
+    static T loadAcquire(const volatile T *p) {
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    }
+    template<typename T>
+    static T loadRelaxed(const volatile T *p) {
+        return __atomic_load_n(p, __ATOMIC_RELAXED);
+    }
+    template<typename T>
+    static void store(volatile T *p, T value) {
+        __atomic_store_n(p, value, __ATOMIC_SEQ_CST);
+    }
+    template<typename T>
+    static void storeRelease(volatile T *p, T value) {
+        __atomic_store_n(p, value, __ATOMIC_RELEASE);
+    }
+    template<typename T>
+    static void storeRelaxed(volatile T *p, T value) {
+        __atomic_store_n(p, value, __ATOMIC_RELAXED);
+    }
+    template<typename T>
+    static T exchange(volatile T *p, T value) {
+        return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+    }
+    //Returns the previous value
+    template<typename T>
+    static T fetchAdd(volatile T *p, T value) {
+        return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+    }
+    //On failure expected is updated with the current value
+    template<typename T>
+    static bool compareExchange(volatile T *p, T &expected, T desired) {
+        return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    static void fence() {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    //Spin-wait hint, keeps the sibling hyper-thread going
+    static void pause() {
+#if defined(__i386__) || defined(__x86_64__)
+        _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield");
+#else
+        __asm__ __volatile__("" ::: "memory");
+#endif
+    }
+    static void yield() {
+        sched_yield();
+    }
+};
+
+#elif defined(_MSC_VER)
+//Interlocked functions are full barriers, volatile accesses are acquire/release
+//with /volatile:ms (the default on x86)
+struct UniAtomic {
+    template<typename T>
+    static T load(const volatile T *p) {
+        T value = *p;
+        _ReadWriteBarrier();
+        return value;
+    }
+    template<typename T>
+    static T loadAcquire(const volatile T *p) {
+        return load(p);
+    }
+    template<typename T>
+    static T loadRelaxed(const volatile T *p) {
+        return *p;
+    }
+    template<typename T>
+    static void store(volatile T *p, T value) {
+        exchange(p, value);
+    }
+    template<typename T>
+    static void storeRelease(volatile T *p, T value) {
+        _ReadWriteBarrier();
+        *p = value;
+    }
+    template<typename T>
+    static void storeRelaxed(volatile T *p, T value) {
+        *p = value;
+    }
+    template<typename T>
+    static T exchange(volatile T *p, T value) {
+        T current = load(p);
+        while(!compareExchange(p, current, value)) {}
+        return current;
+    }
+    template<typename T>
+    static T fetchAdd(volatile T *p, T value) {
+        T current = load(p);
+        while(!compareExchange(p, current, static_cast<T>(current + value))) {}
+        return current;
+    }
+    //T has to be 4 or 8 bytes wide
+    template<typename T>
+    static bool compareExchange(volatile T *p, T &expected, T desired) {
+        if(sizeof(T) == 8) {
+            __int64 e, d, r;
+            memcpy(&e, &expected, 8);
+            memcpy(&d, &desired, 8);
+            r = _InterlockedCompareExchange64(reinterpret_cast<volatile __int64 *>(p), d, e);
+            memcpy(&expected, &r, 8);
+            return r == e;
+        }
+        long e = 0, d = 0, r;
+        memcpy(&e, &expected, sizeof(T));
+        memcpy(&d, &desired, sizeof(T));
+        r = _InterlockedCompareExchange(reinterpret_cast<volatile long *>(p), d, e);
+        memcpy(&expected, &r, sizeof(T));
+        return r == e;
+    }
+    static void fence() {
+        MemoryBarrier();
+    }
+    static void pause() {
+        YieldProcessor();
+    }
+    static void yield() {
+        SwitchToThread();
+    }
+};
+#endif
+
+}//namespace utils
+
+#endif
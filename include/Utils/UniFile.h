@@ -18,27 +18,75 @@
 #define _UNI_FILE_H
 
 #include <fstream>
-#if defined(_WIN32)
-#include <codecvt>
-#endif
-#include <locale>
 #include <wchar.h>
+#include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <new>
 #include <string>
+#include <vector>
 #ifdef __linux__
 #include <tr1/memory>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
 #else
 #include <memory>
 #endif
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
 #include "UniException.h"
+#include "UniUtf8.h"
+#include "UniMutex.hpp"
+#include "UniThread.hpp"
+
+//Regular files of at least this size are read through the memory-mapped backend
+#ifndef UNI_FILE_MMAP_THRESHOLD
+#define UNI_FILE_MMAP_THRESHOLD (16 * 1024 * 1024)
+#endif
+
+//Default size and alignment of the read-ahead buffer of the stream backed readers
+#ifndef UNI_FILE_BUFFER_SIZE
+#define UNI_FILE_BUFFER_SIZE (1024 * 1024)
+#endif
+#ifndef UNI_FILE_BUFFER_ALIGNMENT
+#define UNI_FILE_BUFFER_ALIGNMENT 4096
+#endif
+
+//Number of blocks in flight and the room kept in front of each one in the UF_READ_ASYNC mode
+#ifndef UNI_FILE_ASYNC_BLOCKS
+#define UNI_FILE_ASYNC_BLOCKS 3
+#endif
+#ifndef UNI_FILE_ASYNC_HEADROOM
+#define UNI_FILE_ASYNC_HEADROOM (64 * 1024)
+#endif
 
 namespace utils {
 
 class UniFile {
 public:
-    enum UFMode { UF_READ, UF_WRITE };
+    //UF_READ_MAPPED forces the memory-mapped backend regardless of the file size,
+    //UF_READ_ASYNC reads ahead in a background thread while the caller consumes the data
+    enum UFMode { UF_READ, UF_WRITE, UF_READ_MAPPED, UF_READ_ASYNC };
+    //Options of UF_WRITE: start a new file with a UTF-8 BOM, append instead of truncating,
+    //fdatasync on every flush, write through O_DIRECT (Linux, ignored where unsupported)
+    enum UFFlags { UF_BOM = 1, UF_APPEND = 2, UF_DATASYNC = 4, UF_DIRECT = 8 };
 public:
-    UniFile(const std::string &fileName, UFMode fileMode);
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    //bufferSize is the read-ahead buffer size of the stream backed readers or the write buffer
+    //size, flags is a combination of UFFlags used with UF_WRITE
+    UniFile(const std::string &fileName, UFMode fileMode, std::size_t bufferSize = UNI_FILE_BUFFER_SIZE,
+            unsigned int flags = 0);
+    //Reads only length bytes starting at offset, the encoding is still taken from the file start
+    UniFile(const std::string &fileName, std::size_t offset, std::size_t length, UFMode fileMode = UF_READ,
+            std::size_t bufferSize = UNI_FILE_BUFFER_SIZE);
     ~UniFile();
 
     bool is_open() const;
@@ -57,27 +105,97 @@ public:
     char peek();
     wchar_t widepeek();
 
+    //A line returned by nextline() without its '\n'. The view points into the internal
+    //buffer or the mapped file and stays valid only until the next read from the file.
+    template<typename CH>
+    struct basic_line_view {
+        const CH *data;
+        std::size_t size;
+    };
+    typedef basic_line_view<char> line_view;
+    typedef basic_line_view<wchar_t> wline_view;
+
+    template<typename CH>
+    class basic_line_iterator;
+    typedef basic_line_iterator<char> line_iterator;
+    typedef basic_line_iterator<wchar_t> wline_iterator;
+
+    //Returns false when there are no more lines. Narrow views of UTF-8 files hold the raw bytes.
+    bool nextline(line_view &line);
+    bool nextline(wline_view &line);
+
+    //Fills the buffer with up to count bytes or decoded wide characters, ignoring lines.
+    //Returns the number stored, less than count only at the end of the file.
+    std::size_t read(char *buffer, std::size_t count);
+    std::size_t read(wchar_t *buffer, std::size_t count);
+
+    //Writing needs UF_WRITE. Bytes are written as they are, wide characters encoded as UTF-8.
+    std::size_t write(const char *data, std::size_t count);
+    std::size_t write(const wchar_t *data, std::size_t count);
+    //Appends all the parts at once, with a single gathered system call when they exceed the buffer
+    std::size_t writev(const line_view *parts, std::size_t count);
+    //Hands the buffered data to the system
+    void flush();
+
     bool is_widechar() const;
+    bool is_mapped() const;
+    //Number of malformed UTF-8 sequences replaced with U+FFFD so far
+    std::size_t malformed() const;
 
 public:
     class InternalInterface;
 private:
     UniFile(const UniFile &);
     UniFile &operator=(const UniFile &);
+    void open(const std::string &fileName, UFMode fileMode, std::size_t bufferSize, std::size_t offset, std::size_t length);
+#if defined(__linux__)
+    static bool is_large_regular(const std::string &fileName);
+#endif
 private:
     std::tr1::shared_ptr< InternalInterface > mFile;
     bool mWide;
+    bool mMapped;
 };
 
 inline
 bool UniFile::is_widechar() const {
     return mWide;
 }
+inline
+bool UniFile::is_mapped() const {
+    return mMapped;
+}
+
+//Input iterator over the lines of a file, the default constructed one marks the end
+template<typename CH>
+class UniFile::basic_line_iterator {
+public:
+    basic_line_iterator() : mFile(NULL) {
+        mLine.data = NULL;
+        mLine.size = 0;
+    }
+    explicit basic_line_iterator(UniFile &file) : mFile(&file) {
+        ++*this;
+    }
+    const basic_line_view<CH> &operator*() const { return mLine; }
+    const basic_line_view<CH> *operator->() const { return &mLine; }
+    basic_line_iterator &operator++() {
+        if(!mFile->nextline(mLine))
+            mFile = NULL;
+        return *this;
+    }
+    bool operator==(const basic_line_iterator &other) const { return mFile == other.mFile; }
+    bool operator!=(const basic_line_iterator &other) const { return mFile != other.mFile; }
+private:
+    UniFile *mFile;
+    basic_line_view<CH> mLine;
+};
 
 #define BOM_UTF8_ID 0x00bfbbef
 class UniFile::InternalInterface {
 public:
 //	InternalInterface() {}
+    virtual ~InternalInterface() {}
     virtual bool is_open() const = 0;
     virtual bool eof() const = 0;
 
@@ -90,120 +208,891 @@ public:
     virtual void getline(wchar_t *str, std::streamsize count) = 0;
     virtual char peek() = 0;
     virtual wchar_t widepeek() = 0;
+    virtual std::size_t malformed() const = 0;
+    virtual bool nextline(const char *&line, std::size_t &len) = 0;
+    virtual bool nextline(const wchar_t *&line, std::size_t &len) = 0;
+    virtual std::size_t read(char *buffer, std::size_t count) = 0;
+    virtual std::size_t read(wchar_t *buffer, std::size_t count) = 0;
+    virtual std::size_t write(const char *data, std::size_t count) {
+        (void)data;
+        (void)count;
+        throw UniException("File is not open for writing");
+    }
+    virtual std::size_t write(const wchar_t *data, std::size_t count) {
+        (void)data;
+        (void)count;
+        throw UniException("File is not open for writing");
+    }
+    virtual std::size_t writev(const UniFile::line_view *parts, std::size_t count) {
+        (void)parts;
+        (void)count;
+        throw UniException("File is not open for writing");
+    }
+    virtual void flush() {}
+};
+
+//Common part of the backends which keep the file content in a byte window [mCur, mEnd).
+//Subclasses provide the data through underflow(). With mUtf8 set the content is decoded
+//as UTF-8 for the wide accessors, the narrow accessors always see the raw bytes.
+class Buffered_F : public UniFile::InternalInterface {
+public:
+    inline bool eof() const { return mEof; }
+    inline std::size_t malformed() const { return mMalformed; }
+
+    inline void get() {
+        if(mUtf8) {
+            wchar_t wc;
+            get(wc);
+        }
+        else if(available(1))
+            ++mCur;
+        else
+            mEof = true;
+    }
+    inline void get(char &c) {
+        if(available(1))
+            c = *mCur++;
+        else
+            mEof = true;
+    }
+    inline void get(wchar_t &c) {
+        unsigned long cp;
+        std::size_t n = decodeNext(cp);
+        if(n == 0) {
+            mEof = true;
+            return;
+        }
+        c = static_cast<wchar_t>(cp);
+        mCur += n;
+    }
+    inline char peek() {
+        if(available(1))
+            return *mCur;
+        mEof = true;
+        return static_cast<char>(EOF);
+    }
+    inline wchar_t widepeek() {
+        unsigned long cp;
+        if(decodeNext(cp) == 0) {
+            mEof = true;
+            return static_cast<wchar_t>(WEOF);
+        }
+        return static_cast<wchar_t>(cp);
+    }
+
+    void get(char *str, std::streamsize count) { copyLine(str, count, false); }
+    void getline(char *str, std::streamsize count) { copyLine(str, count, true); }
+    void get(wchar_t *str, std::streamsize count) { copyLine(str, count, false); }
+    void getline(wchar_t *str, std::streamsize count) { copyLine(str, count, true); }
+
+    //The line is left in the window and returned without the '\n'
+    bool nextline(const char *&line, std::size_t &len) {
+        std::size_t scanned = 0;
+        for(;;) {
+            std::size_t size = static_cast<std::size_t>(mEnd - mCur);
+            const char *nl = static_cast<const char *>(memchr(mCur + scanned, '\n', size - scanned));
+            if(nl) {
+                line = mCur;
+                len = static_cast<std::size_t>(nl - mCur);
+                mCur = nl + 1;
+                return true;
+            }
+            scanned = size;
+            available(size + 1);
+            if(static_cast<std::size_t>(mEnd - mCur) == size)
+                break;
+        }
+        if(scanned == 0) {
+            mEof = true;
+            return false;
+        }
+        line = mCur;
+        len = scanned;
+        mCur = mEnd;
+        return true;
+    }
+    //Wide lines are decoded into a buffer reused between calls
+    bool nextline(const wchar_t *&line, std::size_t &len) {
+        const char *bytes;
+        std::size_t size;
+        if(!nextline(bytes, size))
+            return false;
+        if(mWideLine.size() < size + 1)
+            mWideLine.resize(size + 1);
+        wchar_t *out = &mWideLine[0];
+        if(mUtf8) {
+            std::size_t used;
+            len = utf8::decode(bytes, size, out, size, utf8::NO_DELIMITER, true, used, mMalformed);
+        }
+        else {
+            for(std::size_t i = 0; i < size; ++i)
+                out[i] = widen(bytes[i]);
+            len = size;
+        }
+        out[len] = L'\0';
+        line = out;
+        return true;
+    }
+
+    std::size_t read(char *buffer, std::size_t count) {
+        std::size_t got = 0;
+        while(got < count) {
+            if(mCur == mEnd) {
+                std::size_t direct = bypass(buffer + got, count - got);
+                got += direct;
+                if(direct || got == count)
+                    continue;
+            }
+            if(!available(1)) {
+                mEof = true;
+                break;
+            }
+            std::size_t len = static_cast<std::size_t>(mEnd - mCur);
+            if(count - got < len)
+                len = count - got;
+            memcpy(buffer + got, mCur, len);
+            got += len;
+            mCur += len;
+        }
+        return got;
+    }
+    std::size_t read(wchar_t *buffer, std::size_t count) {
+        std::size_t got = 0;
+        while(got < count) {
+            if(!available(1)) {
+                mEof = true;
+                break;
+            }
+            std::size_t len = static_cast<std::size_t>(mEnd - mCur);
+            if(mUtf8) {
+                std::size_t used;
+                got += utf8::decode(mCur, len, buffer + got, count - got, utf8::NO_DELIMITER, mExhausted, used, mMalformed);
+                mCur += used;
+                //A sequence split by the end of the window, fetch the rest of it
+                if(mCur < mEnd && mEnd - mCur < 4)
+                    available(4);
+                else if(mCur < mEnd)
+                    break;
+            }
+            else {
+                if(count - got < len)
+                    len = count - got;
+                const unsigned char *bytes = reinterpret_cast<const unsigned char *>(mCur);
+                std::size_t i = 0;
+                while(i < len) {
+                    i += utf8::detail::widen_run(bytes + i, len - i, utf8::NO_DELIMITER, buffer + got + i);
+                    if(i < len) {
+                        buffer[got + i] = widen(mCur[i]);
+                        ++i;
+                    }
+                }
+                got += len;
+                mCur += len;
+            }
+        }
+        return got;
+    }
+
+protected:
+    explicit Buffered_F(bool utf8) : mCur(NULL), mEnd(NULL), mUtf8(utf8), mEof(false), mExhausted(false), mMalformed(0) {}
+
+    //Makes more data available past mEnd keeping the unread bytes [mCur, mEnd).
+    //Returns false when there is nothing more to read.
+    virtual bool underflow() = 0;
+    //May read count bytes directly into dst when the window is empty, returns how many it did
+    virtual std::size_t bypass(char *dst, std::size_t count) {
+        (void)dst;
+        (void)count;
+        return 0;
+    }
+
+    //Page aligned buffers for the backends reading through a stream
+    static char *allocate(std::size_t size) {
+        void *mem = NULL;
+#if defined(_WIN32)
+        mem = _aligned_malloc(size, UNI_FILE_BUFFER_ALIGNMENT);
+#else
+        if(posix_memalign(&mem, UNI_FILE_BUFFER_ALIGNMENT, size) != 0)
+            mem = NULL;
+#endif
+        if(!mem)
+            throw std::bad_alloc();
+        return static_cast<char *>(mem);
+    }
+    static void release(char *mem) {
+#if defined(_WIN32)
+        _aligned_free(mem);
+#else
+        free(mem);
+#endif
+    }
+    void skipBom() {
+        if(available(3) && static_cast<std::size_t>(mEnd - mCur) >= 3 && memcmp(mCur, "\xEF\xBB\xBF", 3) == 0)
+            mCur += 3;
+    }
+    bool available(std::size_t n) {
+        while(static_cast<std::size_t>(mEnd - mCur) < n && !mExhausted) {
+            if(!underflow())
+                mExhausted = true;
+        }
+        return mEnd > mCur;
+    }
+
+private:
+    static wchar_t widen(char ch) {
+        if(static_cast<unsigned char>(ch) < 0x80)
+            return static_cast<wchar_t>(ch);
+        wchar_t wc = 0;
+        mbstate_t state;
+        memset(&state, 0, sizeof(mbstate_t));
+        mbrtowc(&wc, &ch, 1, &state);
+        return wc;
+    }
+    //Looks at the next character without consuming it, returns its size in bytes or 0 at the end
+    std::size_t decodeNext(unsigned long &cp) {
+        if(!mUtf8) {
+            if(!available(1))
+                return 0;
+            cp = static_cast<unsigned long>(widen(*mCur));
+            return 1;
+        }
+        if(!available(4))
+            return 0;
+        bool bad;
+        std::size_t n = utf8::decode_one(mCur, static_cast<std::size_t>(mEnd - mCur), cp, bad, true);
+        if(bad)
+            ++mMalformed;
+        return n;
+    }
+    //Stops reading a line the way istream::get/getline does
+    void endLine(bool extract) {
+        if(!available(1))
+            mEof = true;
+        else if(extract && *mCur == '\n')
+            ++mCur;
+    }
+    void copyLine(char *str, std::streamsize count, bool extract) {
+        if(count <= 0)
+            return;
+        std::size_t want = static_cast<std::size_t>(count - 1), got = 0;
+        while(got < want && available(1)) {
+            std::size_t len = static_cast<std::size_t>(mEnd - mCur);
+            if(want - got < len)
+                len = want - got;
+            const char *nl = static_cast<const char *>(memchr(mCur, '\n', len));
+            if(nl)
+                len = static_cast<std::size_t>(nl - mCur);
+            memcpy(str + got, mCur, len);
+            got += len;
+            mCur += len;
+            if(nl)
+                break;
+        }
+        str[got] = '\0';
+        endLine(extract);
+    }
+    void copyLine(wchar_t *str, std::streamsize count, bool extract) {
+        if(count <= 0)
+            return;
+        std::size_t want = static_cast<std::size_t>(count - 1), got = 0;
+        while(got < want && available(1)) {
+            std::size_t len = static_cast<std::size_t>(mEnd - mCur);
+            if(mUtf8) {
+                std::size_t used;
+                got += utf8::decode(mCur, len, str + got, want - got, '\n', mExhausted, used, mMalformed);
+                mCur += used;
+                if(mCur == mEnd)
+                    continue;
+                if(*mCur == '\n' || mEnd - mCur >= 4)
+                    break;
+                //A sequence split by the end of the window, fetch the rest of it
+                available(4);
+            }
+            else {
+                if(want - got < len)
+                    len = want - got;
+                std::size_t i = 0;
+                for(; i < len && mCur[i] != '\n'; ++i)
+                    str[got + i] = widen(mCur[i]);
+                got += i;
+                mCur += i;
+                if(i < len)
+                    break;
+            }
+        }
+        str[got] = L'\0';
+        endLine(extract);
+    }
+
+protected:
+    const char *mCur;
+    const char *mEnd;
+    bool mUtf8;
+private:
+    bool mEof;
+    bool mExhausted;
+    std::size_t mMalformed;
+    std::vector<wchar_t> mWideLine;
 };
 
-class Ascii_F : public UniFile::InternalInterface {
+//Reads the file through a stream into an internal buffer. The buffer grows when
+//a single line does not fit in it, so line views never get cut.
+class Stream_F : public Buffered_F {
 public:
-    Ascii_F(const char *fname, const std::ios_base::openmode mode) {
+    Stream_F(const char *fname, const std::ios_base::openmode mode, bool utf8, std::size_t bufferSize,
+             std::size_t offset, std::size_t length) :
+        Buffered_F(utf8), mBuffer(NULL), mCapacity(bufferSize ? bufferSize : UNI_FILE_BUFFER_SIZE), mLimit(length) {
         mFileStream.open(fname, mode);
+        if(offset)
+            mFileStream.seekg(static_cast<std::streamoff>(offset));
+        mBuffer = allocate(mCapacity);
+        mCur = mEnd = mBuffer;
     }
-    ~Ascii_F() {
+    ~Stream_F() {
         mFileStream.close();
+        release(mBuffer);
     }
     inline bool is_open() const { return mFileStream.is_open(); }
-    inline bool eof() const { return mFileStream.eof(); }
-
-    inline void get() { mFileStream.get(); }
-    inline void get(char &c) { mFileStream.get(c); }
-    inline void get(char *str, std::streamsize count) { mFileStream.get(str, count); }
-    inline void getline(char *str, std::streamsize count) { mFileStream.getline(str, count); }
-    inline char peek() { return mFileStream.peek(); }
-    inline wchar_t widepeek() { return mFileStream.peek(); }
-
-    void get(wchar_t &c) { 
-        char ch;
-        mFileStream.get(ch); 
-        mbstate_t state;
-        memset(&state, 0, sizeof(mbstate_t)); 
-        mbrtowc(&c, &ch, 1, &state); 
+
+protected:
+    bool underflow() {
+        if(!mFileStream.good() || mLimit == 0)
+            return false;
+        std::size_t keep = static_cast<std::size_t>(mEnd - mCur);
+        if(keep == mCapacity) {
+            char *grown = allocate(mCapacity * 2);
+            memcpy(grown, mCur, keep);
+            release(mBuffer);
+            mBuffer = grown;
+            mCapacity *= 2;
+        }
+        else
+            memmove(mBuffer, mCur, keep);
+        std::size_t n = fetch(mBuffer + keep, mCapacity - keep);
+        mCur = mBuffer;
+        mEnd = mBuffer + keep + n;
+        return n > 0;
     }
-    void get(wchar_t *str, std::streamsize count) { 
-        char *chr = new char[static_cast<unsigned int>(count)];
-        mFileStream.get(chr, count);
-        mbstate_t state;
-        memset(&state, 0, sizeof(mbstate_t)); 
-        mbrtowc(str, chr, static_cast<std::size_t>(count), &state); 
-        delete [] chr;
+    //Requests at least as large as the buffer skip it and go straight to the stream
+    std::size_t bypass(char *dst, std::size_t count) {
+        if(count < mCapacity || !mFileStream.good())
+            return 0;
+        return fetch(dst, count);
     }
-    void getline(wchar_t *str, std::streamsize count) {
-        char *chr = new char[static_cast<unsigned int>(count)];
-        mFileStream.getline(chr, count);
-        mbstate_t state;
-        memset(&state, 0, sizeof(mbstate_t)); 
-        mbrtowc(str, chr, static_cast<std::size_t>(count), &state); 
-        delete [] chr;
+
+private:
+    //Reads from the stream without passing the end of the range
+    std::size_t fetch(char *dst, std::size_t count) {
+        if(count > mLimit)
+            count = mLimit;
+        mFileStream.read(dst, static_cast<std::streamsize>(count));
+        std::size_t n = static_cast<std::size_t>(mFileStream.gcount());
+        if(mLimit != UniFile::npos)
+            mLimit -= n;
+        return n;
     }
 
 private:
-    std::string mStr;
+    Stream_F(const Stream_F &);
+    Stream_F &operator=(const Stream_F &);
+private:
+    char *mBuffer;
+    std::size_t mCapacity;
+    std::size_t mLimit;
     std::ifstream mFileStream;
 };
-class UTF8_F : public UniFile::InternalInterface {
+
+class Ascii_F : public Stream_F {
+public:
+    Ascii_F(const char *fname, const std::ios_base::openmode mode, std::size_t bufferSize = UNI_FILE_BUFFER_SIZE,
+            std::size_t offset = 0, std::size_t length = UniFile::npos) :
+        Stream_F(fname, mode, false, bufferSize, offset, length) {}
+};
+
+//UTF-8 text is decoded with utf8::decode instead of a locale, so it works
+//without any UTF-8 locale installed.
+class UTF8_F : public Stream_F {
 public:
-    UTF8_F(const char *fname, const std::ios_base::openmode mode) {
+    UTF8_F(const char *fname, const std::ios_base::openmode mode, std::size_t bufferSize = UNI_FILE_BUFFER_SIZE,
+           std::size_t offset = 0, std::size_t length = UniFile::npos) :
+        Stream_F(fname, mode | std::ios::binary, true, bufferSize, offset, length) {
+        if(offset == 0)
+            skipBom();
+    }
+};
+
+//A background UniThread reads the next blocks while the consumer decodes the current one.
+//The blocks are handed over in a ring of UNI_FILE_ASYNC_BLOCKS buffers. Each block keeps
+//headroom in front of its data so the unread tail of the previous block can be put right
+//before it and the window stays contiguous. When the thread can not be started the
+//blocks are read by the consumer, as they are needed.
+class Async_F : public Buffered_F {
+public:
+    Async_F(const char *fname, const std::ios_base::openmode mode, bool utf8, std::size_t bufferSize,
+            std::size_t offset, std::size_t length) :
+        Buffered_F(utf8), mBlockSize(bufferSize ? bufferSize : UNI_FILE_BUFFER_SIZE), mLimit(length),
+        mProduced(0), mReleased(0), mConsumed(0), mFinished(false), mStop(false), mOpen(false), mThreaded(false) {
         mFileStream.open(fname, mode);
-#if defined(_WIN32)
-        const std::locale empty_locale;
-        typedef std::codecvt_utf8<wchar_t> converter_type;
-        const converter_type* converter = new converter_type;
-        const std::locale utf8_locale = std::locale(empty_locale, converter);
-        mFileStream.imbue(utf8_locale);
+        if(offset)
+            mFileStream.seekg(static_cast<std::streamoff>(offset));
+        mOpen = mFileStream.is_open();
+        for(std::size_t i = 0; i < UNI_FILE_ASYNC_BLOCKS; ++i) {
+            mBlocks[i].memory = allocate(UNI_FILE_ASYNC_HEADROOM + mBlockSize);
+            mBlocks[i].length = 0;
+            mBlocks[i].last = false;
+        }
+        mThreaded = mThread.createNewThread(&Async_F::produce, this, UniThreadOptions());
+        if(mUtf8 && offset == 0)
+            skipBom();
+    }
+    ~Async_F() {
+        {
+            UniScopedLock lock(mMutex);
+            mStop = true;
+            mCondition.broadcast();
+        }
+        if(mThreaded)
+            mThread.join();
+        mFileStream.close();
+        for(std::size_t i = 0; i < UNI_FILE_ASYNC_BLOCKS; ++i)
+            release(mBlocks[i].memory);
+    }
+    inline bool is_open() const { return mOpen; }
+
+protected:
+    bool underflow() {
+        if(mFinished)
+            return false;
+        Block *block;
+        if(!mThreaded) {
+            //The window holds one block at most, the next slot is free
+            block = &mBlocks[mConsumed % UNI_FILE_ASYNC_BLOCKS];
+            readBlock(block);
+            ++mProduced;
+        }
+        else {
+            UniScopedLock lock(mMutex);
+            while(mProduced == mConsumed)
+                mCondition.wait(mMutex);
+            block = &mBlocks[mConsumed % UNI_FILE_ASYNC_BLOCKS];
+        }
+        if(block->last)
+            mFinished = true;
+        if(block->length == 0) {
+            releaseBlock();
+            return false;
+        }
+
+        char *data = block->memory + UNI_FILE_ASYNC_HEADROOM;
+        std::size_t keep = static_cast<std::size_t>(mEnd - mCur);
+        if(keep <= UNI_FILE_ASYNC_HEADROOM) {
+            memcpy(data - keep, mCur, keep);
+            mCur = data - keep;
+        }
+        else {
+            //A line longer than the headroom, assemble the window aside
+            std::vector<char> carry(keep + block->length);
+            memcpy(&carry[0], mCur, keep);
+            memcpy(&carry[keep], data, block->length);
+            mCarry.swap(carry);
+            mCur = &mCarry[0];
+            data = &mCarry[keep];
+        }
+        mEnd = data + block->length;
+        //The previous block is no longer referenced by the window
+        if(mConsumed > 0)
+            releaseBlock();
+        ++mConsumed;
+        return true;
+    }
+
+private:
+    struct Block {
+        char *memory;
+        std::size_t length;
+        bool last;
+    };
+
+    void releaseBlock() {
+        UniScopedLock lock(mMutex);
+        ++mReleased;
+        mCondition.broadcast();
+    }
+
+    void readBlock(Block *block) {
+        std::size_t count = mBlockSize;
+        if(count > mLimit)
+            count = mLimit;
+        mFileStream.read(block->memory + UNI_FILE_ASYNC_HEADROOM, static_cast<std::streamsize>(count));
+        block->length = static_cast<std::size_t>(mFileStream.gcount());
+        if(mLimit != UniFile::npos)
+            mLimit -= block->length;
+        block->last = !mFileStream.good() || mLimit == 0;
+    }
+
+    static void *produce(void *arg) {
+        Async_F *self = static_cast<Async_F *>(arg);
+        for(;;) {
+            Block *block;
+            {
+                UniScopedLock lock(self->mMutex);
+                while(!self->mStop && self->mProduced - self->mReleased == UNI_FILE_ASYNC_BLOCKS)
+                    self->mCondition.wait(self->mMutex);
+                if(self->mStop)
+                    return NULL;
+                block = &self->mBlocks[self->mProduced % UNI_FILE_ASYNC_BLOCKS];
+            }
+            self->readBlock(block);
+            {
+                UniScopedLock lock(self->mMutex);
+                ++self->mProduced;
+                self->mCondition.broadcast();
+            }
+            if(block->last)
+                return NULL;
+        }
+    }
+
+private:
+    Async_F(const Async_F &);
+    Async_F &operator=(const Async_F &);
+private:
+    Block mBlocks[UNI_FILE_ASYNC_BLOCKS];
+    std::size_t mBlockSize;
+    std::size_t mLimit;
+    //Counters of blocks filled by the producer, given back and taken by the consumer
+    std::size_t mProduced;
+    std::size_t mReleased;
+    std::size_t mConsumed;
+    bool mFinished;
+    bool mStop;
+    bool mOpen;
+    //The producer thread runs
+    bool mThreaded;
+    std::vector<char> mCarry;
+    std::ifstream mFileStream;
+    UniMutex mMutex;
+    UniCondition mCondition;
+    UniThread mThread;
+};
+
+#if defined(__linux__)
+//Serves reads straight from the pages of a read-only mapping of the whole file,
+//bypassing the stream layer.
+class MMap_F : public Buffered_F {
+public:
+    MMap_F(const char *fname, bool utf8, std::size_t offset = 0, std::size_t length = UniFile::npos) :
+        Buffered_F(utf8), mData(NULL), mSize(0), mOpen(false) {
+        int fd = open(fname, O_RDONLY);
+        if(fd < 0)
+            return;
+        struct stat st;
+        if(fstat(fd, &st) == 0) {
+            std::size_t fileSize = static_cast<std::size_t>(st.st_size);
+            if(offset > fileSize)
+                offset = fileSize;
+            if(length > fileSize - offset)
+                length = fileSize - offset;
+            //The mapping has to start on a page boundary
+            std::size_t lead = offset % static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+            mSize = lead + length;
+            if(length == 0) {
+                mOpen = true;
+            }
+            else {
+                void *data = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(offset - lead));
+                if(data != MAP_FAILED) {
+                    madvise(data, mSize, MADV_SEQUENTIAL);
+                    mData = static_cast<const char *>(data);
+                    mCur = mData + lead;
+                    mEnd = mData + mSize;
+                    mOpen = true;
+                }
+            }
+        }
+        ::close(fd);
+        if(mUtf8 && offset == 0)
+            skipBom();
+    }
+    ~MMap_F() {
+        if(mData)
+            munmap(const_cast<char *>(mData), mSize);
+    }
+    inline bool is_open() const { return mOpen; }
+
+protected:
+    bool underflow() { return false; }
+
+private:
+    MMap_F(const MMap_F &);
+    MMap_F &operator=(const MMap_F &);
+private:
+    const char *mData;
+    std::size_t mSize;
+    bool mOpen;
+};
 #endif
+//Writes through a large coalescing buffer, wide text is encoded as UTF-8.
+//Reads on a writer see an empty file.
+class Writer_F : public Buffered_F {
+public:
+    Writer_F(const char *fname, std::size_t bufferSize, unsigned int flags) :
+        Buffered_F(true), mBuffer(NULL), mCapacity(bufferSize ? bufferSize : UNI_FILE_BUFFER_SIZE), mUsed(0),
+        mFlags(flags), mOffset(0), mHandle(-1), mFile(NULL) {
+        //Direct I/O needs whole aligned blocks
+        mCapacity = (mCapacity + UNI_FILE_BUFFER_ALIGNMENT - 1) / UNI_FILE_BUFFER_ALIGNMENT * UNI_FILE_BUFFER_ALIGNMENT;
+        mBuffer = allocate(mCapacity);
+        mCur = mEnd = mBuffer;
+        std::size_t existing = 0;
 #if defined(__linux__)
+        int oflags = O_RDWR | O_CREAT | ((flags & UniFile::UF_APPEND) ? 0 : O_TRUNC);
+        if(flags & UniFile::UF_DIRECT) {
+            mHandle = ::open(fname, oflags | O_DIRECT, 0666);
+            //The file system may not support O_DIRECT
+            if(mHandle < 0 && errno == EINVAL)
+                mFlags &= ~UniFile::UF_DIRECT;
+        }
+        if(mHandle < 0)
+            mHandle = ::open(fname, oflags, 0666);
+        if(mHandle < 0)
+            return;
+        struct stat st;
+        if(fstat(mHandle, &st) == 0)
+            existing = static_cast<std::size_t>(st.st_size);
+        if(mFlags & UniFile::UF_DIRECT) {
+            //Appending keeps the buffer on a block boundary, load the partial last block
+            mOffset = existing / UNI_FILE_BUFFER_ALIGNMENT * UNI_FILE_BUFFER_ALIGNMENT;
+            mUsed = existing - mOffset;
+            if(mUsed) {
+                setDirect(false);
+                if(pread(mHandle, mBuffer, mUsed, static_cast<off_t>(mOffset)) != static_cast<ssize_t>(mUsed))
+                    fail();
+                setDirect(true);
+            }
+        }
+        else
+            mOffset = existing;
+#else
+        mFile = fopen(fname, (flags & UniFile::UF_APPEND) ? "ab" : "wb");
+        if(!mFile)
+            return;
+        fseek(mFile, 0, SEEK_END);
+        existing = static_cast<std::size_t>(ftell(mFile));
+#endif
+        if((flags & UniFile::UF_BOM) && existing == 0)
+            write("\xEF\xBB\xBF", 3);
+    }
+    ~Writer_F() {
         try {
-            mFileStream.imbue(std::locale("pl_PL.UTF-8"));
+            sync();
         }
-        catch (std::runtime_error &e) {
-            throw UniException("Locale pl_PL.UTF-8 missing. ", e.what());
+        catch (UniException &) {
         }
+#if defined(__linux__)
+        if(mHandle >= 0)
+            ::close(mHandle);
+#else
+        if(mFile)
+            fclose(mFile);
 #endif
-        wchar_t wc;
-        wc = mFileStream.get();
+        release(mBuffer);
     }
-    ~UTF8_F() {
-        mFileStream.close();
+#if defined(__linux__)
+    inline bool is_open() const { return mHandle >= 0; }
+#else
+    inline bool is_open() const { return mFile != NULL; }
+#endif
+
+    std::size_t write(const char *data, std::size_t count) {
+        //Blocks larger than the buffer go straight to the file
+        if(count >= mCapacity && !(mFlags & UniFile::UF_DIRECT)) {
+            const char *parts[2] = { mBuffer, data };
+            std::size_t sizes[2] = { mUsed, count };
+            put(parts, sizes, 2);
+            mUsed = 0;
+            return count;
+        }
+        std::size_t done = 0;
+        while(done < count) {
+            if(mUsed == mCapacity)
+                drain();
+            std::size_t len = mCapacity - mUsed;
+            if(count - done < len)
+                len = count - done;
+            memcpy(mBuffer + mUsed, data + done, len);
+            mUsed += len;
+            done += len;
+        }
+        return count;
+    }
+    //Encoded in pieces through the byte write(), the direct mode may not drain a
+    //nearly full buffer
+    std::size_t write(const wchar_t *data, std::size_t count) {
+        char encoded[256];
+        std::size_t done = 0;
+        while(done < count) {
+            std::size_t used;
+            std::size_t n = utf8::encode(data + done, count - done, encoded, sizeof(encoded), used);
+            write(encoded, n);
+            done += used;
+        }
+        return count;
+    }
+    std::size_t writev(const UniFile::line_view *parts, std::size_t count) {
+        std::size_t total = 0;
+        for(std::size_t i = 0; i < count; ++i)
+            total += parts[i].size;
+        if(mUsed + total <= mCapacity || (mFlags & UniFile::UF_DIRECT)) {
+            for(std::size_t i = 0; i < count; ++i)
+                write(parts[i].data, parts[i].size);
+            return total;
+        }
+        //One gathered write of the buffer and all the parts
+        std::vector<const char *> datas(count + 1);
+        std::vector<std::size_t> sizes(count + 1);
+        datas[0] = mBuffer;
+        sizes[0] = mUsed;
+        for(std::size_t i = 0; i < count; ++i) {
+            datas[i + 1] = parts[i].data;
+            sizes[i + 1] = parts[i].size;
+        }
+        put(&datas[0], &sizes[0], count + 1);
+        mUsed = 0;
+        return total;
+    }
+    void flush() {
+        sync();
     }
-    inline bool is_open() const { return mFileStream.is_open(); }
-    inline bool eof() const { return mFileStream.eof(); }
 
-    inline void get() { mFileStream.get(); }
-    void get(char &c) { 
-        wchar_t ch;
-        mFileStream.get(ch);
-        wcstombs(&c, &ch, 1); 
+protected:
+    bool underflow() { return false; }
+
+private:
+    void fail() {
+        throw UniException("Write failed ", strerror(errno));
     }
-    void get(char *str, std::streamsize count) { 
-        wchar_t *chr = new wchar_t[static_cast<unsigned int>(count)];
-        mFileStream.get(chr, count);
-        mbstate_t state;
-        wcstombs(str, chr, static_cast<std::size_t>(count)); 
-        delete [] chr;
-    }
-    void getline(char *str, std::streamsize count) {
-        wchar_t *chr = new wchar_t[static_cast<unsigned int>(count)];
-        mFileStream.getline(chr, count);
-        wcstombs(str, chr, static_cast<std::size_t>(count)); 
-        delete [] chr;
-    }
-    inline void get(wchar_t &c) { mFileStream.get(c); }
-    inline void get(wchar_t *str, std::streamsize count) { mFileStream.get(str, count); }
-    inline void getline(wchar_t *str, std::streamsize count) { mFileStream.getline(str, count); }
-    inline char peek() { 
-        char c;
-        wchar_t wc = mFileStream.peek(); 
-        wcstombs(&c, &wc, 1);
-        return c;
-    }
-    inline wchar_t widepeek() { return mFileStream.peek(); }
+    //Writes the buffer out, in the direct mode the unaligned tail stays buffered
+    void drain() {
+#if defined(__linux__)
+        if(mFlags & UniFile::UF_DIRECT) {
+            std::size_t aligned = mUsed / UNI_FILE_BUFFER_ALIGNMENT * UNI_FILE_BUFFER_ALIGNMENT;
+            if(aligned) {
+                const char *parts[1] = { mBuffer };
+                std::size_t sizes[1] = { aligned };
+                put(parts, sizes, 1);
+                memmove(mBuffer, mBuffer + aligned, mUsed - aligned);
+                mUsed -= aligned;
+            }
+            return;
+        }
+#endif
+        const char *parts[1] = { mBuffer };
+        std::size_t sizes[1] = { mUsed };
+        put(parts, sizes, 1);
+        mUsed = 0;
+    }
+    //Makes everything written so far reach the file, and the disk with UF_DATASYNC
+    void sync() {
+        drain();
+#if defined(__linux__)
+        if(mUsed) {
+            //The unaligned tail of the direct mode is written through the page cache
+            //and rewritten as a whole block once the buffer fills up
+            setDirect(false);
+            if(pwrite(mHandle, mBuffer, mUsed, static_cast<off_t>(mOffset)) != static_cast<ssize_t>(mUsed))
+                fail();
+            setDirect(true);
+        }
+        if((mFlags & UniFile::UF_DATASYNC) && mHandle >= 0 && fdatasync(mHandle) != 0)
+            fail();
+#else
+        if(mFile && fflush(mFile) != 0)
+            fail();
+#endif
+    }
+    //Gathered write of the parts at the current offset
+    void put(const char **datas, std::size_t *sizes, std::size_t count) {
+#if defined(__linux__)
+        std::vector<struct iovec> iov;
+        iov.reserve(count);
+        for(std::size_t i = 0; i < count; ++i) {
+            if(sizes[i]) {
+                struct iovec v = { const_cast<char *>(datas[i]), sizes[i] };
+                iov.push_back(v);
+            }
+        }
+        std::size_t first = 0;
+        while(first < iov.size()) {
+            int n = static_cast<int>(iov.size() - first);
+            if(n > IOV_MAX)
+                n = IOV_MAX;
+            ssize_t written = pwritev(mHandle, &iov[first], n, static_cast<off_t>(mOffset));
+            if(written < 0) {
+                if(errno == EINTR)
+                    continue;
+                fail();
+            }
+            mOffset += static_cast<std::size_t>(written);
+            //Skip what was written, a partial write leaves the rest of a part
+            std::size_t left = static_cast<std::size_t>(written);
+            while(first < iov.size() && left >= iov[first].iov_len)
+                left -= iov[first++].iov_len;
+            if(left) {
+                iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + left;
+                iov[first].iov_len -= left;
+            }
+        }
+#else
+        for(std::size_t i = 0; i < count; ++i) {
+            if(sizes[i] && fwrite(datas[i], 1, sizes[i], mFile) != sizes[i])
+                fail();
+        }
+#endif
+    }
+#if defined(__linux__)
+    void setDirect(bool on) {
+        if(!(mFlags & UniFile::UF_DIRECT))
+            return;
+        int fl = fcntl(mHandle, F_GETFL);
+        fcntl(mHandle, F_SETFL, on ? (fl | O_DIRECT) : (fl & ~O_DIRECT));
+    }
+#endif
 
 private:
-    std::wstring mStr;
-    std::wifstream mFileStream;
+    Writer_F(const Writer_F &);
+    Writer_F &operator=(const Writer_F &);
+private:
+    char *mBuffer;
+    std::size_t mCapacity;
+    std::size_t mUsed;
+    unsigned int mFlags;
+    //File position of the first buffered byte
+    std::size_t mOffset;
+    int mHandle;
+    FILE *mFile;
 };
+
 inline
-UniFile::UniFile(const std::string &fileName, UFMode fileMode):mWide(false) {
+UniFile::UniFile(const std::string &fileName, UFMode fileMode, std::size_t bufferSize, unsigned int flags):
+    mWide(false), mMapped(false) {
+    if(fileMode == UF_WRITE) {
+        mFile.reset( new Writer_F( fileName.c_str(), bufferSize, flags ) );
+        if(!mFile->is_open())
+            throw UniException("Cannot open file for writing ", fileName);
+        mWide = (flags & UF_BOM) != 0;
+        return;
+    }
+    open(fileName, fileMode, bufferSize, 0, npos);
+}
+inline
+UniFile::UniFile(const std::string &fileName, std::size_t offset, std::size_t length, UFMode fileMode, std::size_t bufferSize):
+    mWide(false), mMapped(false) {
+    open(fileName, fileMode, bufferSize, offset, length);
+}
+inline
+void UniFile::open(const std::string &fileName, UFMode fileMode, std::size_t bufferSize, std::size_t offset, std::size_t length) {
     std::ifstream stream(fileName.c_str(), std::ios::in | std::ios::binary);
-    unsigned int identity;
+    unsigned int identity = 0;
     if(stream.is_open()) {
         stream.read((char *)&identity, sizeof(unsigned int));
         stream.close();
@@ -211,18 +1100,40 @@ UniFile::UniFile(const std::string &fileName, UFMode fileMode):mWide(false) {
     else
         throw UniException("File is missing ", fileName);
 
-    std::ios_base::openmode mode = (fileMode == UF_READ) ? std::ios::in : std::ios::out;
-    if((identity & BOM_UTF8_ID) == BOM_UTF8_ID) {
-        mFile.reset( new UTF8_F( fileName.c_str(), mode ) );
-        mWide = true;
-    }else {
-        mFile.reset( new Ascii_F( fileName.c_str(), mode) );
-        mWide = false;
+    std::ios_base::openmode mode = (fileMode == UF_WRITE) ? std::ios::out : std::ios::in;
+    if(offset != 0 || length != npos)
+        mode |= std::ios::binary;
+    mWide = (identity & BOM_UTF8_ID) == BOM_UTF8_ID;
+    if(fileMode == UF_READ_ASYNC) {
+        mFile.reset( new Async_F( fileName.c_str(), mWide ? (mode | std::ios::binary) : mode, mWide, bufferSize, offset, length ) );
+        return;
+    }
+#if defined(__linux__)
+    if(fileMode == UF_READ_MAPPED || (fileMode == UF_READ && is_large_regular(fileName))) {
+        mFile.reset( new MMap_F( fileName.c_str(), mWide, offset, length ) );
+        mMapped = true;
+    }
+    else
+#endif
+    if(mWide) {
+        mFile.reset( new UTF8_F( fileName.c_str(), mode, bufferSize, offset, length ) );
+    }
+    else {
+        mFile.reset( new Ascii_F( fileName.c_str(), mode, bufferSize, offset, length ) );
     }
 }
 inline
 UniFile::~UniFile() {
 }
+#if defined(__linux__)
+inline
+bool UniFile::is_large_regular(const std::string &fileName) {
+    struct stat st;
+    if(stat(fileName.c_str(), &st) != 0)
+        return false;
+    return S_ISREG(st.st_mode) && st.st_size >= static_cast<off_t>(UNI_FILE_MMAP_THRESHOLD);
+}
+#endif
 inline
 bool UniFile::is_open() const {
     return mFile->is_open();
@@ -267,6 +1178,42 @@ inline
 wchar_t UniFile::widepeek() { 
     return mFile->widepeek();
 }
+inline
+bool UniFile::nextline(line_view &line) {
+    return mFile->nextline(line.data, line.size);
+}
+inline
+bool UniFile::nextline(wline_view &line) {
+    return mFile->nextline(line.data, line.size);
+}
+inline
+std::size_t UniFile::read(char *buffer, std::size_t count) {
+    return mFile->read(buffer, count);
+}
+inline
+std::size_t UniFile::read(wchar_t *buffer, std::size_t count) {
+    return mFile->read(buffer, count);
+}
+inline
+std::size_t UniFile::write(const char *data, std::size_t count) {
+    return mFile->write(data, count);
+}
+inline
+std::size_t UniFile::write(const wchar_t *data, std::size_t count) {
+    return mFile->write(data, count);
+}
+inline
+std::size_t UniFile::writev(const line_view *parts, std::size_t count) {
+    return mFile->writev(parts, count);
+}
+inline
+void UniFile::flush() {
+    mFile->flush();
+}
+inline
+std::size_t UniFile::malformed() const {
+    return mFile->malformed();
+}
 
 }//namespace utils
 
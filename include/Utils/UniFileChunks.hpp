@@ -0,0 +1,153 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_FILE_CHUNKS_HPP
+#define _UNI_FILE_CHUNKS_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <exception>
+#include "UniFile.h"
+#include "UniThread.hpp"
+#include "ArrayPtr.hpp"
+#include "UniException.h"
+
+namespace utils {
+
+//Part of a file, chunks of one split are numbered in file order
+struct UniFileChunk {
+    std::size_t index;
+    std::size_t offset;
+    std::size_t length;
+};
+
+//Splits a file into chunks which start right after a '\n', so every chunk holds
+//whole lines. A '\n' byte never occurs inside a UTF-8 sequence, so the split is
+//UTF-8 safe as well.
+class UniFileChunks {
+public:
+    static std::vector<UniFileChunk> split(const std::string &fileName, std::size_t count);
+
+    //Runs func(UniFile &reader, const UniFileChunk &chunk) for every chunk, each in its own
+    //thread with its own reader. func is shared by all threads, results merged by chunk.index
+    //come out in file order.
+    template<typename FUNC>
+    static void scan(const std::string &fileName, std::size_t count, FUNC &func);
+
+private:
+    template<typename FUNC>
+    struct Job {
+        const std::string *fileName;
+        const UniFileChunk *chunk;
+        FUNC *func;
+        std::string error;
+    };
+    template<typename FUNC>
+    static void *run(void *arg);
+
+    static std::size_t nextLineStart(std::ifstream &stream, std::size_t from, std::size_t size);
+};
+
+inline
+std::size_t UniFileChunks::nextLineStart(std::ifstream &stream, std::size_t from, std::size_t size) {
+    char block[4096];
+    stream.clear();
+    stream.seekg(static_cast<std::streamoff>(from));
+    while(from < size) {
+        stream.read(block, sizeof(block));
+        std::size_t n = static_cast<std::size_t>(stream.gcount());
+        if(n == 0)
+            break;
+        const char *nl = static_cast<const char *>(memchr(block, '\n', n));
+        if(nl)
+            return from + static_cast<std::size_t>(nl - block) + 1;
+        from += n;
+    }
+    return size;
+}
+
+inline
+std::vector<UniFileChunk> UniFileChunks::split(const std::string &fileName, std::size_t count) {
+    std::ifstream stream(fileName.c_str(), std::ios::in | std::ios::binary);
+    if(!stream.is_open())
+        throw UniException("File is missing ", fileName);
+    stream.seekg(0, std::ios::end);
+    std::size_t size = static_cast<std::size_t>(stream.tellg());
+    if(count == 0)
+        count = 1;
+
+    std::vector<UniFileChunk> chunks(count);
+    std::size_t begin = 0;
+    for(std::size_t i = 0; i < count; ++i) {
+        std::size_t end = size;
+        if(i + 1 < count) {
+            std::size_t target = size / count * (i + 1);
+            //A chunk ends after the first '\n' found at or past the byte just before target
+            end = (target > begin) ? nextLineStart(stream, target - 1, size) : begin;
+        }
+        chunks[i].index = i;
+        chunks[i].offset = begin;
+        chunks[i].length = end - begin;
+        begin = end;
+    }
+    return chunks;
+}
+
+template<typename FUNC>
+void *UniFileChunks::run(void *arg) {
+    Job<FUNC> *job = static_cast<Job<FUNC> *>(arg);
+    try {
+        UniFile reader(*job->fileName, job->chunk->offset, job->chunk->length);
+        (*job->func)(reader, *job->chunk);
+    }
+    catch (std::exception &e) {
+        job->error = e.what();
+    }
+    catch (...) {
+        job->error = "unknown exception";
+    }
+    return NULL;
+}
+
+template<typename FUNC>
+void UniFileChunks::scan(const std::string &fileName, std::size_t count, FUNC &func) {
+    std::vector<UniFileChunk> chunks = split(fileName, count);
+    std::vector< Job<FUNC> > jobs(chunks.size());
+    ArrayPtr<UniThread> threads(new UniThread[chunks.size()]);
+    std::vector<char> started(chunks.size(), 0);
+    for(std::size_t i = 0; i < chunks.size(); ++i) {
+        jobs[i].fileName = &fileName;
+        jobs[i].chunk = &chunks[i];
+        jobs[i].func = &func;
+        started[i] = threads.get()[i].createNewThread(&UniFileChunks::run<FUNC>, &jobs[i], UniThreadOptions());
+    }
+    //Chunks whose thread did not start are scanned here
+    for(std::size_t i = 0; i < chunks.size(); ++i) {
+        if(started[i])
+            threads.get()[i].join();
+        else
+            run<FUNC>(&jobs[i]);
+    }
+    for(std::size_t i = 0; i < jobs.size(); ++i) {
+        if(!jobs[i].error.empty())
+            throw UniException("Chunk scan failed ", jobs[i].error);
+    }
+}
+
+}//namespace utils
+
+#endif
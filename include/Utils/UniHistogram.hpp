@@ -0,0 +1,167 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_HISTOGRAM_HPP
+#define _UNI_HISTOGRAM_HPP
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include "UniException.h"
+
+//Bits of a histogram: a power of two range has 2^(bits - 1) linear sub-buckets, so
+//values are kept within 2^(1 - bits) relative error
+#ifndef UNI_HISTOGRAM_BITS
+#define UNI_HISTOGRAM_BITS 7
+#endif
+
+namespace utils {
+
+//Log-linear (HDR style) histogram of 64-bit values. Every power of two range is
+//split into the same number of linear sub-buckets, so the relative error is fixed
+//and the memory does not depend on the samples: (66 - bits) * 2^(bits - 1) counters,
+//30 KB with the default bits. The counters are allocated by the first record().
+//Histograms with equal bits merge, e.g. one per thread into a total.
+class UniHistogram {
+public:
+    explicit UniHistogram(unsigned bits = UNI_HISTOGRAM_BITS)
+        : mBits(bits < 1 ? 1 : (bits > 16 ? 16 : bits)), mCount(0), mMin(~static_cast<uint64_t>(0)), mMax(0), mSum(0) {}
+
+    void record(uint64_t value, uint64_t count = 1) {
+        if(mCounts.empty())
+            mCounts.resize((66 - mBits) << (mBits - 1), 0);
+        mCounts[index(value)] += count;
+        mCount += count;
+        mSum += double(value) * double(count);
+        if(value < mMin)
+            mMin = value;
+        if(value > mMax)
+            mMax = value;
+    }
+
+    //Adds the samples of other, which has to have the same bits
+    void merge(const UniHistogram &other) {
+        if(other.mBits != mBits)
+            throw UniException("Histogram precision differs");
+        if(other.mCounts.empty())
+            return;
+        if(mCounts.empty())
+            mCounts.resize(other.mCounts.size(), 0);
+        for(std::size_t i = 0; i < mCounts.size(); ++i)
+            mCounts[i] += other.mCounts[i];
+        mCount += other.mCount;
+        mSum += other.mSum;
+        if(other.mMin < mMin)
+            mMin = other.mMin;
+        if(other.mMax > mMax)
+            mMax = other.mMax;
+    }
+
+    void reset() {
+        std::fill(mCounts.begin(), mCounts.end(), 0);
+        mCount = 0;
+        mMin = ~static_cast<uint64_t>(0);
+        mMax = 0;
+        mSum = 0;
+    }
+
+    uint64_t count() const {
+        return mCount;
+    }
+    //0 without samples; not min/max, those are macros in windows.h
+    uint64_t minimum() const {
+        return mCount ? mMin : 0;
+    }
+    uint64_t maximum() const {
+        return mMax;
+    }
+    double mean() const {
+        return mCount ? mSum / double(mCount) : 0.0;
+    }
+
+    //Value percent of the samples are at or below: the top of the sub-bucket the
+    //rank falls in, clamped to the recorded range. 0 without samples.
+    uint64_t percentile(double percent) const {
+        if(!mCount)
+            return 0;
+        double rank = percent / 100.0 * double(mCount);
+        uint64_t target = rank < 1.0 ? 1 : static_cast<uint64_t>(rank);
+        if(double(target) < rank)
+            ++target;
+        if(target > mCount)
+            target = mCount;
+        uint64_t seen = 0;
+        for(std::size_t i = 0; i < mCounts.size(); ++i) {
+            seen += mCounts[i];
+            if(seen >= target) {
+                uint64_t value = highest(i);
+                return value < mMin ? mMin : (value > mMax ? mMax : value);
+            }
+        }
+        return mMax;
+    }
+
+    unsigned bits() const {
+        return mBits;
+    }
+
+private:
+    static unsigned msb(uint64_t value) {
+#if defined(_MSC_VER) && defined(_M_X64)
+        unsigned long bit;
+        _BitScanReverse64(&bit, value | 1);
+        return bit;
+#elif defined(__GNUC__)
+        return 63 - __builtin_clzll(value | 1);
+#else
+        unsigned bit = 0;
+        while(value >>= 1)
+            ++bit;
+        return bit;
+#endif
+    }
+
+    //Values below 2^bits map one to one, above each power of two gets 2^(bits - 1)
+    //counters
+    std::size_t index(uint64_t value) const {
+        unsigned top = msb(value);
+        unsigned bucket = top < mBits ? 0 : top - mBits + 1;
+        return (static_cast<std::size_t>(bucket) << (mBits - 1)) + static_cast<std::size_t>(value >> bucket);
+    }
+
+    //Largest value counted at index i
+    uint64_t highest(std::size_t i) const {
+        std::size_t half = static_cast<std::size_t>(1) << (mBits - 1);
+        unsigned bucket = i < 2 * half ? 0 : static_cast<unsigned>(i / half - 1);
+        uint64_t sub = i - (static_cast<std::size_t>(bucket) << (mBits - 1));
+        return (sub << bucket) + ((static_cast<uint64_t>(1) << bucket) - 1);
+    }
+
+private:
+    unsigned mBits;
+    std::vector<uint64_t> mCounts;
+    uint64_t mCount;
+    uint64_t mMin;
+    uint64_t mMax;
+    double mSum;
+};
+
+}//namespace utils
+
+#endif
@@ -0,0 +1,289 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_LIVE_SETTINGS_HPP
+#define _UNI_LIVE_SETTINGS_HPP
+
+#include <string>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "UniSettings.h"
+#include "UniAtomic.hpp"
+#include "UniMutex.hpp"
+#include "UniThread.hpp"
+#include "ArrayPtr.hpp"
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+//How often the watcher checks for a stop request, and the stat() interval
+//where inotify is not available
+#ifndef UNI_SETTINGS_POLL_MS
+#define UNI_SETTINGS_POLL_MS 200
+#endif
+
+//Reader counters per grace period parity. Threads are spread over them so readers
+//on different cores do not write the same cache line.
+#ifndef UNI_SETTINGS_READER_SLOTS
+#define UNI_SETTINGS_READER_SLOTS 32
+#endif
+
+namespace utils {
+
+//UniSettings which follows changes of its file. Every parse produces an immutable
+//snapshot, readers pin the current one with Snapshot and never lock or block.
+//A replaced snapshot is deleted once all readers which could have seen it are gone
+//(two-counter grace period, as in sleepable RCU). A file which fails to parse
+//does not replace the current snapshot.
+class UniLiveSettings {
+private:
+    struct Image {
+        Image(const std::string &fileName) : settings(fileName), version(0) {}
+        UniSettings settings;
+        unsigned long version;
+    };
+    //Readers of one thread slot and grace period parity, on its own cache line
+    struct Readers {
+        volatile long count;
+        char pad[64 - sizeof(long)];
+    };
+
+public:
+    class Snapshot {
+    public:
+        explicit Snapshot(const UniLiveSettings &live)
+            : mReaders(live.readers(UniAtomic::load(&live.mEpoch), threadSlot())) {
+            UniAtomic::fetchAdd(&mReaders->count, 1L);
+            mImage = UniAtomic::load(&live.mCurrent);
+        }
+        //The counter is kept, a Snapshot may end on another thread
+        ~Snapshot() {
+            UniAtomic::fetchAdd(&mReaders->count, -1L);
+        }
+        const UniSettings &operator*() const {
+            return mImage->settings;
+        }
+        const UniSettings *operator->() const {
+            return &mImage->settings;
+        }
+        //Incremented by every successful reload, starting at 0
+        unsigned long version() const {
+            return mImage->version;
+        }
+    private:
+        Snapshot(Snapshot &);
+        Snapshot &operator=(const Snapshot &other);
+    private:
+        static unsigned threadSlot() {
+            static volatile unsigned next = 0;
+            static UNI_THREAD_LOCAL unsigned slot = 0;
+            if(!slot)
+                slot = UniAtomic::fetchAdd(&next, 1u) % UNI_SETTINGS_READER_SLOTS + 1;
+            return slot - 1;
+        }
+    private:
+        Readers *mReaders;
+        const Image *mImage;
+    };
+
+    //With watch set a background thread reloads the file whenever it is rewritten,
+    //if the thread can be started
+    explicit UniLiveSettings(const std::string &fileName, bool watch = true);
+    ~UniLiveSettings();
+
+    //Parses the file and publishes the result, returns false when the file failed
+    //to parse and the previous snapshot stays current. Waits for the Snapshot objects
+    //alive at the time of the call, so the calling thread must not hold one.
+    bool reload();
+
+    //UniSettings::ParseError() of the last parse
+    int parseError() const {
+        return UniAtomic::load(&mError);
+    }
+
+private:
+    UniLiveSettings(UniLiveSettings &);
+    UniLiveSettings &operator=(const UniLiveSettings &other);
+
+    Readers *readers(unsigned parity, unsigned slot) const {
+        return &mReaders[parity * UNI_SETTINGS_READER_SLOTS + slot];
+    }
+    void synchronize();
+    void waitReaders(unsigned slot);
+    bool fileChanged();
+    static void *watch(void *arg);
+    static void sleep(unsigned ms);
+
+private:
+    std::string mFileName;
+    Image * volatile mCurrent;
+    volatile unsigned mEpoch;
+    //Both parities of UNI_SETTINGS_READER_SLOTS counters, cache line aligned in
+    //mReaderMemory
+    ArrayPtr<char> mReaderMemory;
+    Readers *mReaders;
+    volatile int mError;
+    volatile int mStop;
+    bool mWatching;
+    UniMutex mReloadLock;
+    UniThread mWatcher;
+    struct stat mStat;
+};
+
+inline
+UniLiveSettings::UniLiveSettings(const std::string &fileName, bool watch)
+    : mFileName(fileName), mCurrent(NULL), mEpoch(0),
+      mReaderMemory(new char[2 * UNI_SETTINGS_READER_SLOTS * sizeof(Readers) + 64]), mError(0), mStop(0), mWatching(false) {
+    char *memory = mReaderMemory.get();
+    mReaders = reinterpret_cast<Readers *>(memory + (64 - reinterpret_cast<uintptr_t>(memory) % 64) % 64);
+    for(unsigned i = 0; i < 2 * UNI_SETTINGS_READER_SLOTS; ++i)
+        mReaders[i].count = 0;
+    memset(&mStat, 0, sizeof(mStat));
+    fileChanged();
+    mCurrent = new Image(mFileName);
+    mError = mCurrent->settings.ParseError();
+    //Without the thread the file is only read again by reload()
+    if(watch)
+        mWatching = mWatcher.createNewThread(&UniLiveSettings::watch, this, UniThreadOptions());
+}
+
+inline
+UniLiveSettings::~UniLiveSettings() {
+    if(mWatching) {
+        UniAtomic::store(&mStop, 1);
+        mWatcher.join();
+    }
+    delete mCurrent;
+}
+
+inline
+bool UniLiveSettings::reload() {
+    UniScopedLock lock(mReloadLock);
+    Image *next = new Image(mFileName);
+    int error = next->settings.ParseError();
+    UniAtomic::store(&mError, error);
+    if(error != 0) {
+        delete next;
+        return false;
+    }
+    next->version = mCurrent->version + 1;
+    Image *old = UniAtomic::exchange(&mCurrent, next);
+    synchronize();
+    delete old;
+    return true;
+}
+
+//Returns once every reader which started before the call has finished. A reader
+//counts itself on the current parity before loading the snapshot pointer, so
+//every counter of both parities reaching zero after the pointer swap covers all
+//of them. A reader counted after its counter was checked saw the new pointer.
+inline
+void UniLiveSettings::synchronize() {
+    unsigned epoch = UniAtomic::load(&mEpoch);
+    UniAtomic::store(&mEpoch, epoch ^ 1u);
+    waitReaders(epoch);
+    UniAtomic::store(&mEpoch, epoch);
+    waitReaders(epoch ^ 1u);
+}
+
+inline
+void UniLiveSettings::waitReaders(unsigned slot) {
+    for(unsigned i = 0; i < UNI_SETTINGS_READER_SLOTS; ++i) {
+        for(unsigned spin = 0; UniAtomic::load(&readers(slot, i)->count) != 0; ++spin) {
+            if(spin < 64)
+                UniAtomic::pause();
+            else if(spin < 128)
+                UniAtomic::yield();
+            else
+                sleep(1);
+        }
+    }
+}
+
+inline
+bool UniLiveSettings::fileChanged() {
+    struct stat st;
+    if(stat(mFileName.c_str(), &st) != 0)
+        return false;
+    bool changed = st.st_mtime != mStat.st_mtime || st.st_size != mStat.st_size || st.st_ino != mStat.st_ino;
+    mStat = st;
+    return changed;
+}
+
+inline
+void UniLiveSettings::sleep(unsigned ms) {
+#if defined(_WIN32)
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+inline
+void *UniLiveSettings::watch(void *arg) {
+    UniLiveSettings *live = static_cast<UniLiveSettings *>(arg);
+#if defined(__linux__)
+    //Editors often write a new file and rename it over the old one, so the directory
+    //is watched rather than the file
+    std::string::size_type slash = live->mFileName.rfind('/');
+    std::string dir = (slash == std::string::npos) ? std::string(".") : live->mFileName.substr(0, slash + 1);
+    std::string name = (slash == std::string::npos) ? live->mFileName : live->mFileName.substr(slash + 1);
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if(fd >= 0) {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while(!UniAtomic::load(&live->mStop)) {
+            struct pollfd p = { fd, POLLIN, 0 };
+            if(poll(&p, 1, UNI_SETTINGS_POLL_MS) <= 0)
+                continue;
+            bool changed = false;
+            ssize_t len;
+            while((len = read(fd, events, sizeof(events))) > 0) {
+                for(char *e = events; e < events + len; ) {
+                    const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(e);
+                    if(event->len && name == event->name)
+                        changed = true;
+                    e += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            if(changed)
+                live->reload();
+        }
+        close(fd);
+        return NULL;
+    }
+#endif
+    while(!UniAtomic::load(&live->mStop)) {
+        sleep(UNI_SETTINGS_POLL_MS);
+        if(live->fileChanged())
+            live->reload();
+    }
+    return NULL;
+}
+
+}//namespace utils
+
+#endif
@@ -24,6 +24,8 @@
 #include <pthread.h>
 #else
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #endif
 #endif
 
@@ -33,55 +35,520 @@
 #endif
 #include <pthread.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "UniAtomic.hpp"
+
+//Spins of UniAdaptiveMutex before it sleeps in the kernel
+#ifndef UNI_MUTEX_SPIN_COUNT
+#define UNI_MUTEX_SPIN_COUNT 100
+#endif
+
+//With UNI_MUTEX_STATS defined, UniMutex objects constructed with a name count their
+//acquisitions, contention, wait and hold times in UniLockRegistry. Without it the
+//name is ignored and UniMutex is a bare mutex.
+#ifdef UNI_MUTEX_STATS
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <time.h>
 #endif
 
 namespace utils {
 
+#ifdef UNI_MUTEX_STATS
+//Totals of one name, times in nanoseconds
+struct UniLockCounters {
+    UniLockCounters() : acquisitions(0), contended(0), waitTotal(0), waitMax(0), holdTotal(0), holdMax(0) {}
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t waitTotal;
+    uint64_t waitMax;
+    uint64_t holdTotal;
+    uint64_t holdMax;
+};
+
+//Counters of one mutex. Updated by the owner of the mutex only, read by the registry
+//with relaxed loads.
+class UniLockStats {
+public:
+    explicit UniLockStats(const char *name) : mName(name), mLockedAt(0) {
+        mAcquisitions = mContended = mWaitTotal = mWaitMax = mHoldTotal = mHoldMax = 0;
+    }
+    static uint64_t now() {
+#ifdef _WIN32
+        LARGE_INTEGER counter, frequency;
+        QueryPerformanceCounter(&counter);
+        QueryPerformanceFrequency(&frequency);
+        return static_cast<uint64_t>(counter.QuadPart / (double)frequency.QuadPart * 1e9);
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+#endif
+    }
+    void contention(uint64_t wait) {
+        add(mContended, 1);
+        add(mWaitTotal, wait);
+        if(wait > mWaitMax)
+            UniAtomic::storeRelaxed(&mWaitMax, wait);
+    }
+    void acquired() {
+        add(mAcquisitions, 1);
+        mLockedAt = now();
+    }
+    void released() {
+        uint64_t hold = now() - mLockedAt;
+        add(mHoldTotal, hold);
+        if(hold > mHoldMax)
+            UniAtomic::storeRelaxed(&mHoldMax, hold);
+    }
+    const std::string &name() const {
+        return mName;
+    }
+    void addTo(UniLockCounters &counters) const {
+        counters.acquisitions += UniAtomic::loadRelaxed(&mAcquisitions);
+        counters.contended += UniAtomic::loadRelaxed(&mContended);
+        counters.waitTotal += UniAtomic::loadRelaxed(&mWaitTotal);
+        counters.holdTotal += UniAtomic::loadRelaxed(&mHoldTotal);
+        uint64_t waitMax = UniAtomic::loadRelaxed(&mWaitMax);
+        uint64_t holdMax = UniAtomic::loadRelaxed(&mHoldMax);
+        if(waitMax > counters.waitMax)
+            counters.waitMax = waitMax;
+        if(holdMax > counters.holdMax)
+            counters.holdMax = holdMax;
+    }
+private:
+    static void add(volatile uint64_t &counter, uint64_t value) {
+        UniAtomic::storeRelaxed(&counter, UniAtomic::loadRelaxed(&counter) + value);
+    }
+private:
+    std::string mName;
+    uint64_t mLockedAt;
+    volatile uint64_t mAcquisitions;
+    volatile uint64_t mContended;
+    volatile uint64_t mWaitTotal;
+    volatile uint64_t mWaitMax;
+    volatile uint64_t mHoldTotal;
+    volatile uint64_t mHoldMax;
+};
+
+//Defined with UniLockRegistry below
+inline UniLockStats *attachLockStats(const char *name);
+inline void detachLockStats(UniLockStats *stats);
+#endif
+
 #ifdef USE_POSIX_PTHREAD
 class UniMutex {
 public:
     UniMutex() {
         pthread_mutex_init(&mM, NULL);
+#ifdef UNI_MUTEX_STATS
+        mStats = NULL;
+#endif
+    }
+    //The name identifies the mutex in UniLockRegistry
+    explicit UniMutex(const char *name) {
+        pthread_mutex_init(&mM, NULL);
+#ifdef UNI_MUTEX_STATS
+        mStats = attachLockStats(name);
+#else
+        (void)name;
+#endif
     }
     void lock() {
+#ifdef UNI_MUTEX_STATS
+        if(mStats) {
+            if(pthread_mutex_trylock(&mM) != 0) {
+                uint64_t start = UniLockStats::now();
+                pthread_mutex_lock(&mM);
+                mStats->contention(UniLockStats::now() - start);
+            }
+            mStats->acquired();
+            return;
+        }
+#endif
         pthread_mutex_lock (&mM);
     }
     void unlock() {
+#ifdef UNI_MUTEX_STATS
+        if(mStats)
+            mStats->released();
+#endif
         pthread_mutex_unlock(&mM);
     }
+    //True when the mutex was acquired
     bool trylock() {
-        return (pthread_mutex_trylock (&mM) == EBUSY);
+        bool locked = (pthread_mutex_trylock (&mM) == 0);
+#ifdef UNI_MUTEX_STATS
+        if(locked && mStats)
+            mStats->acquired();
+#endif
+        return locked;
     }
     ~UniMutex() {
+#ifdef UNI_MUTEX_STATS
+        if(mStats)
+            detachLockStats(mStats);
+#endif
         pthread_mutex_destroy (&mM);
     }
 private:
+    friend class UniCondition;
     UniMutex(UniMutex &);
     UniMutex &operator=(const UniMutex &other);
 private:
     pthread_mutex_t mM;
+#ifdef UNI_MUTEX_STATS
+    UniLockStats *mStats;
+#endif
+};
+
+class UniCondition {
+public:
+    UniCondition() {
+        pthread_cond_init(&mC, NULL);
+    }
+    //The mutex has to be locked by the caller
+    void wait(UniMutex &m) {
+#ifdef UNI_MUTEX_STATS
+        if(m.mStats)
+            m.mStats->released();
+        pthread_cond_wait(&mC, &m.mM);
+        if(m.mStats)
+            m.mStats->acquired();
+#else
+        pthread_cond_wait(&mC, &m.mM);
+#endif
+    }
+    void signal() {
+        pthread_cond_signal(&mC);
+    }
+    void broadcast() {
+        pthread_cond_broadcast(&mC);
+    }
+    ~UniCondition() {
+        pthread_cond_destroy(&mC);
+    }
+private:
+    UniCondition(UniCondition &);
+    UniCondition &operator=(const UniCondition &other);
+private:
+    pthread_cond_t mC;
 };
 #else
 class UniMutex {
 public:
-    UniMutex() {}
+    UniMutex() {
+#ifdef UNI_MUTEX_STATS
+        mStats = NULL;
+#endif
+    }
+    //The name identifies the mutex in UniLockRegistry
+    explicit UniMutex(const char *name) {
+#ifdef UNI_MUTEX_STATS
+        mStats = attachLockStats(name);
+#else
+        (void)name;
+#endif
+    }
     void lock() {
+#ifdef UNI_MUTEX_STATS
+        if(mStats) {
+            if(!mM.try_lock()) {
+                uint64_t start = UniLockStats::now();
+                mM.lock();
+                mStats->contention(UniLockStats::now() - start);
+            }
+            mStats->acquired();
+            return;
+        }
+#endif
         mM.lock();
     }
     void unlock() {
+#ifdef UNI_MUTEX_STATS
+        if(mStats)
+            mStats->released();
+#endif
         mM.unlock();
     }
     bool trylock() {
-        return mM.try_lock();
+        bool locked = mM.try_lock();
+#ifdef UNI_MUTEX_STATS
+        if(locked && mStats)
+            mStats->acquired();
+#endif
+        return locked;
     }
     ~UniMutex() {
+#ifdef UNI_MUTEX_STATS
+        if(mStats)
+            detachLockStats(mStats);
+#endif
         mM.destroy();
     }
 private:
+    friend class UniCondition;
     UniMutex(UniMutex &);
     UniMutex &operator=(const UniMutex &other);
 private:
     boost::mutex mM;
+#ifdef UNI_MUTEX_STATS
+    UniLockStats *mStats;
+#endif
+};
+
+class UniCondition {
+public:
+    UniCondition() {}
+    //The mutex has to be locked by the caller
+    void wait(UniMutex &m) {
+#ifdef UNI_MUTEX_STATS
+        if(m.mStats)
+            m.mStats->released();
+        mC.wait(m.mM);
+        if(m.mStats)
+            m.mStats->acquired();
+#else
+        mC.wait(m.mM);
+#endif
+    }
+    void signal() {
+        mC.notify_one();
+    }
+    void broadcast() {
+        mC.notify_all();
+    }
+private:
+    UniCondition(UniCondition &);
+    UniCondition &operator=(const UniCondition &other);
+private:
+    boost::condition_variable_any mC;
+};
+#endif
+
+#ifdef __linux__
+//Process private futex calls on a 32 bit word
+struct UniFutex {
+    static void wait(volatile int *addr, int value) {
+        syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+    }
+    static void wake(volatile int *addr, int count) {
+        syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+    }
+};
+
+//Mutex for short critical sections: spins with a pause hint while the owner is
+//likely to release it soon, then sleeps on a futex. States: 0 unlocked, 1 locked,
+//2 locked with possible sleepers (unlock only enters the kernel then).
+class UniAdaptiveMutex {
+public:
+    explicit UniAdaptiveMutex(unsigned spinCount = UNI_MUTEX_SPIN_COUNT) : mState(0), mSpin(spinCount) {}
+    void lock() {
+        for(unsigned spin = 0; spin < mSpin; ++spin) {
+            int expected = 0;
+            if(UniAtomic::loadRelaxed(&mState) == 0 && UniAtomic::compareExchange(&mState, expected, 1))
+                return;
+            UniAtomic::pause();
+        }
+        int state = UniAtomic::exchange(&mState, 2);
+        while(state != 0) {
+            UniFutex::wait(&mState, 2);
+            state = UniAtomic::exchange(&mState, 2);
+        }
+    }
+    void unlock() {
+        if(UniAtomic::exchange(&mState, 0) == 2)
+            UniFutex::wake(&mState, 1);
+    }
+    bool trylock() {
+        int expected = 0;
+        return UniAtomic::compareExchange(&mState, expected, 1);
+    }
+private:
+    UniAdaptiveMutex(UniAdaptiveMutex &);
+    UniAdaptiveMutex &operator=(const UniAdaptiveMutex &other);
+private:
+    volatile int mState;
+    unsigned mSpin;
+};
+#else
+//Spins on trylock before blocking in UniMutex
+class UniAdaptiveMutex {
+public:
+    explicit UniAdaptiveMutex(unsigned spinCount = UNI_MUTEX_SPIN_COUNT) : mSpin(spinCount) {}
+    void lock() {
+        for(unsigned spin = 0; spin < mSpin; ++spin) {
+            if(mM.trylock())
+                return;
+            UniAtomic::pause();
+        }
+        mM.lock();
+    }
+    void unlock() {
+        mM.unlock();
+    }
+    bool trylock() {
+        return mM.trylock();
+    }
+private:
+    UniAdaptiveMutex(UniAdaptiveMutex &);
+    UniAdaptiveMutex &operator=(const UniAdaptiveMutex &other);
+private:
+    UniMutex mM;
+    unsigned mSpin;
+};
+#endif
+
+#ifdef __linux__
+//Writer-preferring reader-writer lock. mState counts readers in steps of 2, bit 0
+//marks the writer. mWriters counts waiting and active writers, new readers stay out
+//while it is nonzero. Readers take the lock with a single atomic add when no writer
+//is around, sleepers are counted so unlocks only enter the kernel when needed.
+class UniRWLock {
+public:
+    UniRWLock() : mState(0), mWriters(0), mStateSleepers(0), mReaderSleepers(0) {}
+    void lockShared() {
+        for(unsigned spin = 0; ; ++spin) {
+            int writers = UniAtomic::load(&mWriters);
+            if(writers == 0) {
+                if(!(UniAtomic::fetchAdd(&mState, 2) & WRITER))
+                    return;
+                unlockShared();
+            }
+            else if(spin >= UNI_MUTEX_SPIN_COUNT) {
+                UniAtomic::fetchAdd(&mReaderSleepers, 1);
+                UniFutex::wait(&mWriters, writers);
+                UniAtomic::fetchAdd(&mReaderSleepers, -1);
+            }
+            else {
+                UniAtomic::pause();
+            }
+        }
+    }
+    bool trylockShared() {
+        if(UniAtomic::load(&mWriters) != 0)
+            return false;
+        if(!(UniAtomic::fetchAdd(&mState, 2) & WRITER))
+            return true;
+        unlockShared();
+        return false;
+    }
+    void unlockShared() {
+        //The last reader lets a waiting writer in
+        if(UniAtomic::fetchAdd(&mState, -2) == 2 && UniAtomic::load(&mStateSleepers) != 0)
+            UniFutex::wake(&mState, 1);
+    }
+    void lock() {
+        UniAtomic::fetchAdd(&mWriters, 1);
+        for(unsigned spin = 0; ; ++spin) {
+            int state = UniAtomic::load(&mState);
+            if(state == 0 && UniAtomic::compareExchange(&mState, state, static_cast<int>(WRITER)))
+                return;
+            if(spin >= UNI_MUTEX_SPIN_COUNT && state != 0) {
+                UniAtomic::fetchAdd(&mStateSleepers, 1);
+                UniFutex::wait(&mState, state);
+                UniAtomic::fetchAdd(&mStateSleepers, -1);
+            }
+            else {
+                UniAtomic::pause();
+            }
+        }
+    }
+    bool trylock() {
+        int state = 0;
+        UniAtomic::fetchAdd(&mWriters, 1);
+        if(UniAtomic::compareExchange(&mState, state, static_cast<int>(WRITER)))
+            return true;
+        releaseWriter();
+        return false;
+    }
+    void unlock() {
+        UniAtomic::fetchAdd(&mState, -static_cast<int>(WRITER));
+        if(UniAtomic::load(&mStateSleepers) != 0)
+            UniFutex::wake(&mState, 1);
+        releaseWriter();
+    }
+private:
+    enum { WRITER = 1 };
+    void releaseWriter() {
+        if(UniAtomic::fetchAdd(&mWriters, -1) == 1 && UniAtomic::load(&mReaderSleepers) != 0)
+            UniFutex::wake(&mWriters, 0x7fffffff);
+    }
+    UniRWLock(UniRWLock &);
+    UniRWLock &operator=(const UniRWLock &other);
+private:
+    volatile int mState;
+    volatile int mWriters;
+    volatile int mStateSleepers;
+    volatile int mReaderSleepers;
+};
+#elif defined(USE_POSIX_PTHREAD)
+class UniRWLock {
+public:
+    UniRWLock() {
+        pthread_rwlock_init(&mL, NULL);
+    }
+    void lockShared() {
+        pthread_rwlock_rdlock(&mL);
+    }
+    bool trylockShared() {
+        return pthread_rwlock_tryrdlock(&mL) == 0;
+    }
+    void unlockShared() {
+        pthread_rwlock_unlock(&mL);
+    }
+    void lock() {
+        pthread_rwlock_wrlock(&mL);
+    }
+    bool trylock() {
+        return pthread_rwlock_trywrlock(&mL) == 0;
+    }
+    void unlock() {
+        pthread_rwlock_unlock(&mL);
+    }
+    ~UniRWLock() {
+        pthread_rwlock_destroy(&mL);
+    }
+private:
+    UniRWLock(UniRWLock &);
+    UniRWLock &operator=(const UniRWLock &other);
+private:
+    pthread_rwlock_t mL;
+};
+#else
+class UniRWLock {
+public:
+    UniRWLock() {}
+    void lockShared() {
+        mL.lock_shared();
+    }
+    bool trylockShared() {
+        return mL.try_lock_shared();
+    }
+    void unlockShared() {
+        mL.unlock_shared();
+    }
+    void lock() {
+        mL.lock();
+    }
+    bool trylock() {
+        return mL.try_lock();
+    }
+    void unlock() {
+        mL.unlock();
+    }
+private:
+    UniRWLock(UniRWLock &);
+    UniRWLock &operator=(const UniRWLock &other);
+private:
+    boost::shared_mutex mL;
 };
 #endif
 
@@ -101,6 +568,134 @@ private:
     UniMutex &mRef;
 };
 
+//UniScopedLock for any class having lock() and unlock(), e.g. UniAdaptiveMutex
+template<typename MUTEX>
+class UniLockGuard {
+public:
+    explicit UniLockGuard(MUTEX &m) : mRef(m) {
+        mRef.lock();
+    }
+    ~UniLockGuard() {
+        mRef.unlock();
+    }
+private:
+    UniLockGuard();
+    UniLockGuard(UniLockGuard &);
+    UniLockGuard &operator=(const UniLockGuard &other);
+private:
+    MUTEX &mRef;
+};
+
+class UniSharedLock {
+public:
+    UniSharedLock(UniRWLock &l) : mRef(l) {
+        mRef.lockShared();
+    }
+    ~UniSharedLock() {
+        mRef.unlockShared();
+    }
+private:
+    UniSharedLock();
+    UniSharedLock(UniSharedLock &);
+    UniSharedLock &operator=(const UniSharedLock &other);
+private:
+    UniRWLock &mRef;
+};
+
+class UniExclusiveLock {
+public:
+    UniExclusiveLock(UniRWLock &l) : mRef(l) {
+        mRef.lock();
+    }
+    ~UniExclusiveLock() {
+        mRef.unlock();
+    }
+private:
+    UniExclusiveLock();
+    UniExclusiveLock(UniExclusiveLock &);
+    UniExclusiveLock &operator=(const UniExclusiveLock &other);
+private:
+    UniRWLock &mRef;
+};
+
+#ifdef UNI_MUTEX_STATS
+//Named UniMutex objects alive now, and the totals of the destroyed ones. Mutexes
+//sharing a name are reported together.
+class UniLockRegistry {
+public:
+    static UniLockRegistry &instance() {
+        static UniLockRegistry registry;
+        return registry;
+    }
+    //False when no mutex of that name was ever created
+    bool query(const std::string &name, UniLockCounters &counters) const {
+        UniScopedLock lock(mLock);
+        std::map<std::string, UniLockCounters>::const_iterator retired = mRetired.find(name);
+        bool found = retired != mRetired.end();
+        counters = found ? retired->second : UniLockCounters();
+        for(std::size_t i = 0; i < mLive.size(); ++i) {
+            if(mLive[i]->name() == name) {
+                mLive[i]->addTo(counters);
+                found = true;
+            }
+        }
+        return found;
+    }
+    std::map<std::string, UniLockCounters> snapshot() const {
+        UniScopedLock lock(mLock);
+        std::map<std::string, UniLockCounters> all(mRetired);
+        for(std::size_t i = 0; i < mLive.size(); ++i)
+            mLive[i]->addTo(all[mLive[i]->name()]);
+        return all;
+    }
+    //One line per name, times in microseconds
+    void dump(std::ostream &out) const {
+        std::map<std::string, UniLockCounters> all = snapshot();
+        for(std::map<std::string, UniLockCounters>::const_iterator it = all.begin(); it != all.end(); ++it) {
+            const UniLockCounters &c = it->second;
+            out << it->first << ": acquisitions " << c.acquisitions << " contended " << c.contended
+                << " wait " << c.waitTotal / 1000 << "us (max " << c.waitMax / 1000 << "us)"
+                << " hold " << c.holdTotal / 1000 << "us (max " << c.holdMax / 1000 << "us)\n";
+        }
+    }
+private:
+    friend UniLockStats *attachLockStats(const char *name);
+    friend void detachLockStats(UniLockStats *stats);
+    UniLockRegistry() {}
+    UniLockRegistry(UniLockRegistry &);
+    UniLockRegistry &operator=(const UniLockRegistry &other);
+private:
+    //Unnamed, so not instrumented itself
+    mutable UniMutex mLock;
+    std::vector<UniLockStats *> mLive;
+    std::map<std::string, UniLockCounters> mRetired;
+};
+
+inline UniLockStats *attachLockStats(const char *name) {
+    UniLockRegistry &registry = UniLockRegistry::instance();
+    UniLockStats *stats = new UniLockStats(name);
+    UniScopedLock lock(registry.mLock);
+    registry.mLive.push_back(stats);
+    return stats;
+}
+
+inline void detachLockStats(UniLockStats *stats) {
+    UniLockRegistry &registry = UniLockRegistry::instance();
+    {
+        UniScopedLock lock(registry.mLock);
+        stats->addTo(registry.mRetired[stats->name()]);
+        for(std::size_t i = 0; i < registry.mLive.size(); ++i) {
+            if(registry.mLive[i] == stats) {
+                registry.mLive[i] = registry.mLive.back();
+                registry.mLive.pop_back();
+                break;
+            }
+        }
+    }
+    delete stats;
+}
+#endif
+
 }//namespace utils
 
 #endif
@@ -0,0 +1,351 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_PROFILER_HPP
+#define _UNI_PROFILER_HPP
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include "ApplicationTimer.hpp"
+#include "UniThread.hpp"
+#include "UniMutex.hpp"
+#include "UniAtomic.hpp"
+#include "UniQueue.hpp"
+#include "ArrayPtr.hpp"
+
+//Events a thread can hold until the collector drains them, more are dropped
+#ifndef UNI_PROFILE_BUFFER
+#define UNI_PROFILE_BUFFER 16384
+#endif
+
+//PROFILE_SCOPE("name") times the rest of the enclosing scope. It compiles to nothing
+//unless UNI_PROFILE is defined. The name has to outlive the profiler, a literal.
+#define UNI_PROFILE_JOIN2(a, b) a##b
+#define UNI_PROFILE_JOIN(a, b) UNI_PROFILE_JOIN2(a, b)
+#ifdef UNI_PROFILE
+#define PROFILE_SCOPE(name) utils::UniProfileScope UNI_PROFILE_JOIN(uniProfileScope, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name) do {} while(0)
+#endif
+
+namespace utils {
+
+//One timed scope, in TSC ticks
+struct UniProfileEvent {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+//Collects the events of every thread. A thread records into its own wait-free
+//UniSPSCRing, the collector is the only consumer of all of them, so recording
+//never blocks. collect() has to run often enough for the buffers not to fill,
+//startCollector() does it from a background thread. With POSIX threads the buffer
+//of a thread which ended is given to the next new thread once it was drained.
+class UniProfiler {
+public:
+    static UniProfiler &instance() {
+        static UniProfiler profiler;
+        return profiler;
+    }
+
+    //Called by UniProfileScope
+    static void record(const char *name, uint64_t begin, uint64_t end) {
+        ThreadBuffer *buffer = current();
+        if(!buffer)
+            buffer = instance().attach();
+        UniProfileEvent event = { name, begin, end };
+        if(!buffer->events.tryPush(event))
+            UniAtomic::storeRelaxed(&buffer->dropped, UniAtomic::loadRelaxed(&buffer->dropped) + 1);
+    }
+
+    //Shown for the calling thread in the trace
+    void setThreadName(const std::string &name) {
+        ThreadBuffer *buffer = current();
+        if(!buffer)
+            buffer = attach();
+        UniScopedLock lock(mThreadsLock);
+        buffer->name = name;
+    }
+
+    //Moves the buffered events of all threads into the trace. The thread list is
+    //only locked to copy it, threads starting to record do not wait for the drain.
+    void collect() {
+        UniScopedLock lock(mCollectLock);
+        std::vector< std::tr1::shared_ptr<ThreadBuffer> > threads;
+        {
+            UniScopedLock threadsLock(mThreadsLock);
+            threads = mThreads;
+        }
+        UniProfileEvent batch[256];
+        for(std::size_t i = 0; i < threads.size(); ++i) {
+            ThreadBuffer &buffer = *threads[i];
+            //Seen before the drain, so every event of an ended thread is drained
+            bool ended = UniAtomic::loadAcquire(&buffer.state) == ENDED;
+            std::size_t n;
+            while((n = buffer.events.popBatch(batch, 256)) != 0)
+                for(std::size_t k = 0; k < n; ++k)
+                    mCollected.push_back(Collected(batch[k], buffer.id));
+            if(ended)
+                UniAtomic::storeRelease(&buffer.state, static_cast<int>(FREE));
+        }
+    }
+
+    //Collects every intervalMs on a background thread until stopCollector(). False
+    //if the thread could not be started, it may be tried again.
+    bool startCollector(unsigned intervalMs = 10) {
+        UniScopedLock lock(mCollectLock);
+        if(mCollecting)
+            return true;
+        mInterval = intervalMs;
+        UniAtomic::store(&mCollecting, 1);
+        if(!mCollector.createNewThread(&UniProfiler::collectLoop, this, UniThreadOptions())) {
+            UniAtomic::store(&mCollecting, 0);
+            return false;
+        }
+        return true;
+    }
+    void stopCollector() {
+        {
+            UniScopedLock lock(mCollectLock);
+            if(!mCollecting)
+                return;
+            UniAtomic::store(&mCollecting, 0);
+        }
+        mCollector.join();
+    }
+
+    //Events lost to full buffers, over all threads
+    uint64_t dropped() const {
+        UniScopedLock lock(mThreadsLock);
+        uint64_t total = mDropped;
+        for(std::size_t i = 0; i < mThreads.size(); ++i)
+            total += UniAtomic::loadRelaxed(&mThreads[i]->dropped);
+        return total;
+    }
+
+    //Thread buffers held, in use or waiting for a new thread
+    std::size_t buffers() const {
+        UniScopedLock lock(mThreadsLock);
+        return mThreads.size();
+    }
+
+    //Number of events collected so far
+    std::size_t size() const {
+        UniScopedLock lock(mCollectLock);
+        return mCollected.size();
+    }
+
+    //Collects and writes all events as Chrome trace event JSON, which chrome://tracing
+    //and Perfetto open. clear drops the written events. False if the file can not
+    //be written.
+    bool writeTrace(const std::string &fileName, bool clear = true);
+
+    void clear() {
+        UniScopedLock lock(mCollectLock);
+        mCollected.clear();
+        UniScopedLock threadsLock(mThreadsLock);
+        mEndedNames.clear();
+    }
+
+    ~UniProfiler() {
+        stopCollector();
+#ifdef USE_POSIX_PTHREAD
+        pthread_key_delete(mThreadEnd);
+#endif
+    }
+
+private:
+    //A buffer is used by its thread, then ended with it and free once drained
+    enum { LIVE, ENDED, FREE };
+    struct ThreadBuffer {
+        explicit ThreadBuffer(unsigned threadId) : events(UNI_PROFILE_BUFFER), id(threadId), dropped(0), state(LIVE) {}
+        UniSPSCRing<UniProfileEvent> events;
+        unsigned id;
+        std::string name;
+        volatile uint64_t dropped;
+        volatile int state;
+    };
+    struct Collected {
+        Collected(const UniProfileEvent &e, unsigned threadId) : event(e), id(threadId) {}
+        UniProfileEvent event;
+        unsigned id;
+    };
+
+    UniProfiler() : mNextId(0), mDropped(0), mOrigin(timer_detail::Tsc::stamp()), mCollecting(0), mInterval(10) {
+        //Calibrated now, not in the first profiled scope
+        timer_detail::Tsc::secondsPerTick();
+#ifdef USE_POSIX_PTHREAD
+        pthread_key_create(&mThreadEnd, &UniProfiler::threadEnded);
+#endif
+    }
+    UniProfiler(UniProfiler &);
+    UniProfiler &operator=(const UniProfiler &other);
+
+    static ThreadBuffer *&current() {
+        static UNI_THREAD_LOCAL ThreadBuffer *buffer = NULL;
+        return buffer;
+    }
+    //Takes a free buffer under a new id, or makes one
+    ThreadBuffer *attach() {
+        UniScopedLock lock(mThreadsLock);
+        ThreadBuffer *buffer = NULL;
+        for(std::size_t i = 0; i < mThreads.size() && !buffer; ++i) {
+            if(UniAtomic::loadAcquire(&mThreads[i]->state) == FREE)
+                buffer = mThreads[i].get();
+        }
+        if(buffer) {
+            //The trace still names the events of the ended thread
+            if(!buffer->name.empty())
+                mEndedNames.push_back(std::make_pair(buffer->id, buffer->name));
+            mDropped += UniAtomic::loadRelaxed(&buffer->dropped);
+            buffer->id = ++mNextId;
+            buffer->name.clear();
+            UniAtomic::storeRelaxed(&buffer->dropped, static_cast<uint64_t>(0));
+            UniAtomic::store(&buffer->state, static_cast<int>(LIVE));
+        }
+        else {
+            mThreads.push_back(std::tr1::shared_ptr<ThreadBuffer>(new ThreadBuffer(++mNextId)));
+            buffer = mThreads.back().get();
+        }
+#ifdef USE_POSIX_PTHREAD
+        pthread_setspecific(mThreadEnd, buffer);
+#endif
+        current() = buffer;
+        return buffer;
+    }
+#ifdef USE_POSIX_PTHREAD
+    //Thread exit hook, runs on the ending thread. An event recorded later, by another
+    //exit hook, attaches a new buffer.
+    static void threadEnded(void *buffer) {
+        current() = NULL;
+        UniAtomic::storeRelease(&static_cast<ThreadBuffer *>(buffer)->state, static_cast<int>(ENDED));
+    }
+#endif
+    static void *collectLoop(void *arg) {
+        UniProfiler *profiler = static_cast<UniProfiler *>(arg);
+        while(UniAtomic::load(&profiler->mCollecting)) {
+            profiler->collect();
+            utils::sleep(profiler->mInterval);
+        }
+        profiler->collect();
+        return NULL;
+    }
+    static void writeString(FILE *file, const char *text);
+
+private:
+    //Guards mCollected, held through a whole drain
+    mutable UniMutex mCollectLock;
+    //Guards the thread list and names, held briefly
+    mutable UniMutex mThreadsLock;
+    std::vector< std::tr1::shared_ptr<ThreadBuffer> > mThreads;
+    //Names of threads whose buffer went to another thread
+    std::vector< std::pair<unsigned, std::string> > mEndedNames;
+    unsigned mNextId;
+    //Dropped by the threads which ended
+    uint64_t mDropped;
+    std::vector<Collected> mCollected;
+    uint64_t mOrigin;
+    volatile int mCollecting;
+    unsigned mInterval;
+    UniThread mCollector;
+#ifdef USE_POSIX_PTHREAD
+    pthread_key_t mThreadEnd;
+#endif
+};
+
+//Records the time between its construction and destruction, see PROFILE_SCOPE
+class UniProfileScope {
+public:
+    explicit UniProfileScope(const char *name) : mName(name), mBegin(timer_detail::Tsc::stamp()) {}
+    ~UniProfileScope() {
+        UniProfiler::record(mName, mBegin, timer_detail::Tsc::stamp());
+    }
+private:
+    UniProfileScope(UniProfileScope &);
+    UniProfileScope &operator=(const UniProfileScope &other);
+private:
+    const char *mName;
+    uint64_t mBegin;
+};
+
+inline
+void UniProfiler::writeString(FILE *file, const char *text) {
+    fputc('"', file);
+    for(const unsigned char *p = reinterpret_cast<const unsigned char *>(text); *p; ++p) {
+        if(*p == '"' || *p == '\\')
+            fprintf(file, "\\%c", *p);
+        else if(*p < 0x20)
+            fprintf(file, "\\u%04x", *p);
+        else
+            fputc(*p, file);
+    }
+    fputc('"', file);
+}
+
+inline
+bool UniProfiler::writeTrace(const std::string &fileName, bool clear) {
+    collect();
+    FILE *file = fopen(fileName.c_str(), "w");
+    if(!file)
+        return false;
+    UniScopedLock lock(mCollectLock);
+    std::vector< std::pair<unsigned, std::string> > names;
+    {
+        UniScopedLock threadsLock(mThreadsLock);
+        names = mEndedNames;
+        for(std::size_t i = 0; i < mThreads.size(); ++i)
+            names.push_back(std::make_pair(mThreads[i]->id, mThreads[i]->name));
+    }
+    //Microseconds since the profiler was created
+    double scale = timer_detail::Tsc::secondsPerTick() * 1e6;
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for(std::size_t i = 0; i < names.size(); ++i) {
+        if(names[i].second.empty())
+            continue;
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                first ? "" : ",\n", names[i].first);
+        writeString(file, names[i].second.c_str());
+        fprintf(file, "}}");
+        first = false;
+    }
+    for(std::size_t i = 0; i < mCollected.size(); ++i) {
+        const Collected &c = mCollected[i];
+        double begin = double(static_cast<int64_t>(c.event.begin - mOrigin)) * scale;
+        double duration = double(c.event.end - c.event.begin) * scale;
+        fprintf(file, "%s{\"name\":", first ? "" : ",\n");
+        writeString(file, c.event.name);
+        fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", c.id, begin, duration);
+        first = false;
+    }
+    fprintf(file, "\n]}\n");
+    bool ok = ferror(file) == 0;
+    if(fclose(file) != 0)
+        ok = false;
+    if(clear && ok) {
+        mCollected.clear();
+        UniScopedLock threadsLock(mThreadsLock);
+        mEndedNames.clear();
+    }
+    return ok;
+}
+
+}//namespace utils
+
+#endif
@@ -0,0 +1,491 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_QUEUE_HPP
+#define _UNI_QUEUE_HPP
+
+#include <cstddef>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+#include "UniMutex.hpp"
+#include "UniAtomic.hpp"
+#include "ArrayPtr.hpp"
+#include "UniException.h"
+
+//Failed tries of a blocking push/pop before it parks the thread
+#ifndef UNI_QUEUE_SPIN_COUNT
+#define UNI_QUEUE_SPIN_COUNT 100
+#endif
+
+namespace utils {
+
+//Bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's design).
+//Every cell carries a sequence number telling whether it waits for a producer or
+//a consumer of the current lap, so producers and consumers only contend on their
+//own index. capacity is rounded up to a power of two; T has to be default
+//constructible and assignable.
+template<typename T>
+class UniMPMCQueue {
+public:
+    explicit UniMPMCQueue(std::size_t capacity)
+        : mEnqueue(0), mDequeue(0), mMask(roundUp(capacity) - 1), mCells(new Cell[mMask + 1]) {
+        for(std::size_t i = 0; i <= mMask; ++i)
+            UniAtomic::storeRelaxed(&mCells.get()[i].sequence, i);
+    }
+
+    std::size_t capacity() const {
+        return mMask + 1;
+    }
+
+    //false when the queue is full
+    bool tryPush(const T &value) {
+        std::size_t pos = UniAtomic::loadRelaxed(&mEnqueue);
+        Cell *cell;
+        for(;;) {
+            cell = &mCells.get()[pos & mMask];
+            std::size_t sequence = UniAtomic::loadAcquire(&cell->sequence);
+            long diff = static_cast<long>(sequence - pos);
+            if(diff == 0) {
+                if(UniAtomic::compareExchange(&mEnqueue, pos, pos + 1))
+                    break;
+            }
+            else if(diff < 0) {
+                return false;
+            }
+            else {
+                pos = UniAtomic::loadRelaxed(&mEnqueue);
+            }
+        }
+        cell->value = value;
+        UniAtomic::storeRelease(&cell->sequence, pos + 1);
+        return true;
+    }
+
+    //false when the queue is empty
+    bool tryPop(T &value) {
+        std::size_t pos = UniAtomic::loadRelaxed(&mDequeue);
+        Cell *cell;
+        for(;;) {
+            cell = &mCells.get()[pos & mMask];
+            std::size_t sequence = UniAtomic::loadAcquire(&cell->sequence);
+            long diff = static_cast<long>(sequence - (pos + 1));
+            if(diff == 0) {
+                if(UniAtomic::compareExchange(&mDequeue, pos, pos + 1))
+                    break;
+            }
+            else if(diff < 0) {
+                return false;
+            }
+            else {
+                pos = UniAtomic::loadRelaxed(&mDequeue);
+            }
+        }
+        value = cell->value;
+        UniAtomic::storeRelease(&cell->sequence, pos + mMask + 1);
+        return true;
+    }
+
+    //Approximate while other threads use the queue
+    bool empty() const {
+        return UniAtomic::load(&mDequeue) == UniAtomic::load(&mEnqueue);
+    }
+
+private:
+    struct Cell {
+        volatile std::size_t sequence;
+        T value;
+    };
+    UniMPMCQueue(UniMPMCQueue &);
+    UniMPMCQueue &operator=(const UniMPMCQueue &other);
+
+    static std::size_t roundUp(std::size_t capacity) {
+        std::size_t size = 2;
+        while(size < capacity)
+            size *= 2;
+        return size;
+    }
+
+private:
+    //Indices on their own cache lines
+    char mPad0[64];
+    volatile std::size_t mEnqueue;
+    char mPad1[64 - sizeof(std::size_t)];
+    volatile std::size_t mDequeue;
+    char mPad2[64 - sizeof(std::size_t)];
+    std::size_t mMask;
+    ArrayPtr<Cell> mCells;
+};
+
+namespace priv {
+
+//Eventcount: a waiter registers, checks its condition once more and parks only if
+//the epoch did not move meanwhile. notify() costs a fence and a load while nobody
+//waits.
+class EventCount {
+public:
+    EventCount() : mEpoch(0), mWaiters(0) {}
+    int prepare() {
+        UniAtomic::fetchAdd(&mWaiters, 1);
+        return UniAtomic::load(&mEpoch);
+    }
+    void cancel() {
+        UniAtomic::fetchAdd(&mWaiters, -1);
+    }
+    void wait(int epoch) {
+#ifdef __linux__
+        while(UniAtomic::load(&mEpoch) == epoch)
+            UniFutex::wait(&mEpoch, epoch);
+#else
+        {
+            UniScopedLock lock(mMutex);
+            while(UniAtomic::load(&mEpoch) == epoch)
+                mCondition.wait(mMutex);
+        }
+#endif
+        UniAtomic::fetchAdd(&mWaiters, -1);
+    }
+    void notify(bool all) {
+        UniAtomic::fence();
+        if(UniAtomic::loadRelaxed(&mWaiters) == 0)
+            return;
+#ifdef __linux__
+        UniAtomic::fetchAdd(&mEpoch, 1);
+        UniFutex::wake(&mEpoch, all ? 0x7fffffff : 1);
+#else
+        {
+            UniScopedLock lock(mMutex);
+            UniAtomic::fetchAdd(&mEpoch, 1);
+        }
+        if(all)
+            mCondition.broadcast();
+        else
+            mCondition.signal();
+#endif
+    }
+private:
+    volatile int mEpoch;
+    volatile int mWaiters;
+#ifndef __linux__
+    UniMutex mMutex;
+    UniCondition mCondition;
+#endif
+};
+
+}//namespace priv
+
+//UniMPMCQueue whose push/pop spin shortly and then park the thread (on a futex on
+//Linux) until there is room or a value. Threads which never have to wait make no
+//system calls. After close() pushes fail and pops drain what is left, then fail.
+//Pushes in flight are counted, so a pop never reports the queue drained before a
+//push which passed the closed check has landed.
+template<typename T>
+class UniBlockingQueue {
+public:
+    explicit UniBlockingQueue(std::size_t capacity) : mQueue(capacity), mClosed(0), mPushing(0) {}
+
+    std::size_t capacity() const {
+        return mQueue.capacity();
+    }
+
+    bool tryPush(const T &value) {
+        UniAtomic::fetchAdd(&mPushing, 1);
+        bool pushed = !UniAtomic::load(&mClosed) && mQueue.tryPush(value);
+        UniAtomic::fetchAdd(&mPushing, -1);
+        if(!pushed)
+            return false;
+        mNotEmpty.notify(false);
+        return true;
+    }
+
+    bool tryPop(T &value) {
+        if(!mQueue.tryPop(value))
+            return false;
+        mNotFull.notify(false);
+        return true;
+    }
+
+    //Waits while the queue is full, false if it is closed
+    bool push(const T &value) {
+        for(unsigned spin = 0; ; ++spin) {
+            if(UniAtomic::load(&mClosed))
+                return false;
+            if(tryPush(value))
+                return true;
+            if(spin < UNI_QUEUE_SPIN_COUNT) {
+                UniAtomic::pause();
+                continue;
+            }
+            int epoch = mNotFull.prepare();
+            if(UniAtomic::load(&mClosed)) {
+                mNotFull.cancel();
+                return false;
+            }
+            if(tryPush(value)) {
+                mNotFull.cancel();
+                return true;
+            }
+            mNotFull.wait(epoch);
+        }
+    }
+
+    //Waits while the queue is empty, false once it is closed and drained
+    bool pop(T &value) {
+        for(unsigned spin = 0; ; ++spin) {
+            if(tryPop(value))
+                return true;
+            if(UniAtomic::load(&mClosed))
+                return drain(value);
+            if(spin < UNI_QUEUE_SPIN_COUNT) {
+                UniAtomic::pause();
+                continue;
+            }
+            int epoch = mNotEmpty.prepare();
+            if(tryPop(value)) {
+                mNotEmpty.cancel();
+                return true;
+            }
+            if(UniAtomic::load(&mClosed)) {
+                mNotEmpty.cancel();
+                return drain(value);
+            }
+            mNotEmpty.wait(epoch);
+        }
+    }
+
+    //Wakes every waiting thread
+    void close() {
+        UniAtomic::store(&mClosed, 1);
+        mNotEmpty.notify(true);
+        mNotFull.notify(true);
+    }
+
+    bool closed() const {
+        return UniAtomic::load(&mClosed) != 0;
+    }
+
+private:
+    UniBlockingQueue(UniBlockingQueue &);
+    UniBlockingQueue &operator=(const UniBlockingQueue &other);
+
+    //Once closed: pushes which saw the queue open land first, then what is left is taken
+    bool drain(T &value) {
+        for(unsigned spin = 0; UniAtomic::load(&mPushing) != 0; ++spin) {
+            if(spin < UNI_QUEUE_SPIN_COUNT)
+                UniAtomic::pause();
+            else
+                UniAtomic::yield();
+        }
+        return tryPop(value);
+    }
+
+private:
+    UniMPMCQueue<T> mQueue;
+    volatile int mClosed;
+    //tryPush() calls between their closed check and the end of the push
+    volatile int mPushing;
+    priv::EventCount mNotEmpty;
+    priv::EventCount mNotFull;
+};
+
+//Wait-free single-producer/single-consumer ring. One thread (or process) pushes,
+//one pops; each side keeps a private copy of the other side's index and reads the
+//shared one only when the copy says the ring is full or empty.
+//
+//The ring may live in memory shared by two processes, e.g. a MAP_SHARED mapping:
+//
+//  void *memory = mmap(NULL, UniSPSCRing<Message>::requiredSize(1024), ...);
+//  UniSPSCRing<Message> ring(memory, size, true);   //the creating side
+//  UniSPSCRing<Message> ring(memory, size, false);  //the other side
+//
+//Values are copied with memcpy there, so T has to be plain data. capacity is
+//rounded up to a power of two.
+template<typename T>
+class UniSPSCRing {
+public:
+    //Ring in memory owned by the object
+    explicit UniSPSCRing(std::size_t capacity)
+        : mMemory(new char[requiredSize(capacity) + 64]) {
+        //Cache line aligned, for the padding in Header to work
+        char *memory = mMemory.get();
+        init(memory + (64 - reinterpret_cast<uintptr_t>(memory) % 64) % 64, roundUp(capacity));
+    }
+
+    //Ring in external memory of at least requiredSize() bytes. create initializes
+    //it, otherwise the ring set up there is attached; UniException if it is not one.
+    UniSPSCRing(void *memory, std::size_t bytes, bool create) {
+        Header *header = static_cast<Header *>(memory);
+        if(create) {
+            std::size_t capacity = 2;
+            while(requiredSize(capacity * 2) <= bytes)
+                capacity *= 2;
+            if(requiredSize(capacity) > bytes)
+                throw UniException("SPSC ring memory too small");
+            init(memory, capacity);
+            return;
+        }
+        //The magic is published last, the fields are complete once it is seen
+        if(bytes < sizeof(Header) || UniAtomic::loadAcquire(&header->magic) != magic())
+            throw UniException("Not an SPSC ring");
+        uint64_t capacity = header->capacity;
+        if(header->elementSize != sizeof(T) || capacity < 2 || (capacity & (capacity - 1)) != 0
+                || capacity > (bytes - sizeof(Header)) / sizeof(T))
+            throw UniException("Not an SPSC ring");
+        mHeader = header;
+        mData = reinterpret_cast<T *>(static_cast<char *>(memory) + sizeof(Header));
+        mMask = capacity - 1;
+        mHead = UniAtomic::load(&header->head);
+        mTail = UniAtomic::load(&header->tail);
+    }
+
+    //Bytes of external memory needed for capacity values
+    static std::size_t requiredSize(std::size_t capacity) {
+        return sizeof(Header) + roundUp(capacity) * sizeof(T);
+    }
+
+    std::size_t capacity() const {
+        return static_cast<std::size_t>(mMask + 1);
+    }
+
+    //Producer side, false when the ring is full
+    bool tryPush(const T &value) {
+        return pushBatch(&value, 1) == 1;
+    }
+
+    //Producer side, pushes as many of the values as fit and returns their count.
+    //The consumer sees them all at once, after a single index update.
+    std::size_t pushBatch(const T *values, std::size_t count) {
+        uint64_t tail = UniAtomic::loadRelaxed(&mHeader->tail);
+        uint64_t room = mMask + 1 - (tail - mHead);
+        if(room < count) {
+            mHead = UniAtomic::loadAcquire(&mHeader->head);
+            room = mMask + 1 - (tail - mHead);
+        }
+        std::size_t n = room < count ? static_cast<std::size_t>(room) : count;
+        if(n == 0)
+            return 0;
+        copyIn(tail, values, n);
+        UniAtomic::storeRelease(&mHeader->tail, tail + n);
+        return n;
+    }
+
+    //Consumer side, false when the ring is empty
+    bool tryPop(T &value) {
+        return popBatch(&value, 1) == 1;
+    }
+
+    //Consumer side, pops up to max values and returns their count
+    std::size_t popBatch(T *values, std::size_t max) {
+        uint64_t head = UniAtomic::loadRelaxed(&mHeader->head);
+        uint64_t ready = mTail - head;
+        if(ready < max) {
+            mTail = UniAtomic::loadAcquire(&mHeader->tail);
+            ready = mTail - head;
+        }
+        std::size_t n = ready < max ? static_cast<std::size_t>(ready) : max;
+        if(n == 0)
+            return 0;
+        copyOut(head, values, n);
+        UniAtomic::storeRelease(&mHeader->head, head + n);
+        return n;
+    }
+
+    //Approximate from the side which does not own the ring
+    std::size_t size() const {
+        return static_cast<std::size_t>(UniAtomic::load(&mHeader->tail) - UniAtomic::load(&mHeader->head));
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+private:
+    //Shared part, the same layout in every process. Each index has its own cache line.
+    struct Header {
+        //"UNISPSC" once the ring is set up
+        volatile uint64_t magic;
+        uint64_t capacity;
+        uint32_t elementSize;
+        char pad0[64 - 8 - sizeof(uint64_t) - sizeof(uint32_t)];
+        //Written by the producer only
+        volatile uint64_t tail;
+        char pad1[64 - sizeof(uint64_t)];
+        //Written by the consumer only
+        volatile uint64_t head;
+        char pad2[64 - sizeof(uint64_t)];
+    };
+    UniSPSCRing(UniSPSCRing &);
+    UniSPSCRing &operator=(const UniSPSCRing &other);
+
+    static std::size_t roundUp(std::size_t capacity) {
+        std::size_t size = 2;
+        while(size < capacity)
+            size *= 2;
+        return size;
+    }
+    static uint64_t magic() {
+        uint64_t value;
+        memcpy(&value, "UNISPSC", 8);
+        return value;
+    }
+
+    //A process attaching meanwhile sees no magic until every field is written
+    void init(void *memory, std::size_t capacity) {
+        mHeader = static_cast<Header *>(memory);
+        UniAtomic::store(&mHeader->magic, static_cast<uint64_t>(0));
+        mHeader->capacity = capacity;
+        mHeader->elementSize = sizeof(T);
+        UniAtomic::storeRelaxed(&mHeader->tail, static_cast<uint64_t>(0));
+        UniAtomic::storeRelaxed(&mHeader->head, static_cast<uint64_t>(0));
+        mData = reinterpret_cast<T *>(static_cast<char *>(memory) + sizeof(Header));
+        mMask = capacity - 1;
+        mHead = 0;
+        mTail = 0;
+        UniAtomic::storeRelease(&mHeader->magic, magic());
+    }
+
+    //At most two memcpy calls, the range may wrap around the end
+    void copyIn(uint64_t index, const T *values, std::size_t n) {
+        std::size_t start = static_cast<std::size_t>(index & mMask);
+        std::size_t first = std::min(n, static_cast<std::size_t>(mMask + 1) - start);
+        memcpy(mData + start, values, first * sizeof(T));
+        memcpy(mData, values + first, (n - first) * sizeof(T));
+    }
+    void copyOut(uint64_t index, T *values, std::size_t n) const {
+        std::size_t start = static_cast<std::size_t>(index & mMask);
+        std::size_t first = std::min(n, static_cast<std::size_t>(mMask + 1) - start);
+        memcpy(values, mData + start, first * sizeof(T));
+        memcpy(values + first, mData, (n - first) * sizeof(T));
+    }
+
+private:
+    //Read by both sides
+    ArrayPtr<char> mMemory;
+    Header *mHeader;
+    T *mData;
+    uint64_t mMask;
+    //Private copies on their own cache lines, 64 bytes apart whatever the alignment of
+    //the object: the consumer's head as last seen by the producer and the other way
+    char mPad0[64];
+    uint64_t mHead;
+    char mPad1[64 - sizeof(uint64_t)];
+    uint64_t mTail;
+    char mPad2[64 - sizeof(uint64_t)];
+};
+
+}//namespace utils
+
+#endif
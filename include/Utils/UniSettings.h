@@ -7,74 +7,385 @@ Go to the source project home page for more info: http://code.google.com/p/inih/
 #ifndef _UNI_SETTINGS_H
 #define _UNI_SETTINGS_H
 
-#include <map>
 #include <string>
+#include <vector>
 #include <algorithm>
+#include <stdlib.h>
+#include <errno.h>
 #include "CReaderImplement.h"
+#include "CSettingsStore.h"
+#include "UniAtomic.hpp"
+#include "UniThread.hpp"
+#include "ArrayPtr.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+// Default number of threads parsing the files of a layered load
+#ifndef UNI_SETTINGS_LOAD_THREADS
+#define UNI_SETTINGS_LOAD_THREADS 4
+#endif
 
 using std::string;
 
 namespace utils {
 
-// Read an INI file into easy-to-access name/value pairs. (Note that I've gone
-// for simplicity here rather than speed, but it should be pretty decent.)
+// Read an INI file into easy-to-access name/value pairs. Lookups go through a
+// case-insensitive hash index and the (const char*) overloads do not allocate.
 class UniSettings {
 public:
 
-UniSettings(string filename) {
-    _error = priv::CReaderImplement::ini_parse(filename.c_str(), ValueHandler, this);
+// Resolved (section, name) pair, reading through it is a plain array access
+class Handle {
+public:
+    Handle() : _index(priv::CSettingsStore::npos) {}
+    bool Valid() const { return _index != priv::CSettingsStore::npos; }
+private:
+    friend class UniSettings;
+    explicit Handle(uint32_t index) : _index(index) {}
+    uint32_t _index;
+};
+
+// Section/name pair hashed once, for keys resolved over and over
+class Key {
+public:
+    Key(const string& section, const string& name)
+        : _key(MakeKey(section, name)),
+          _hash(priv::CSettingsStore::hash(section.data(), section.size(), name.data(), name.size())) {}
+    const string& Name() const { return _key; }
+private:
+    friend class UniSettings;
+    string _key;
+    uint32_t _hash;
+};
+
+UniSettings(const string& filename) {
+    _error = priv::CReaderImplement::ini_parse_view(filename.c_str(), ViewHandler, this);
+    ConvertValues();
+}
+
+// Maps the binary image when it was built from the current filename, otherwise
+// parses filename and writes the image for the next start. Failing to write the
+// image is not an error.
+UniSettings(const string& filename, const string& imageFile) {
+    int64_t size, time;
+    bool source = priv::CSettingsStore::stamp(filename.c_str(), size, time);
+    if (source && _values.load(imageFile.c_str(), size, time, _error))
+        return;
+    _error = priv::CReaderImplement::ini_parse_view(filename.c_str(), ViewHandler, this);
+    ConvertValues();
+    if (source && _error == 0)
+        _values.save(imageFile.c_str(), _error, size, time);
 }
 
-int ParseError() {
+// Parses the files in parallel (threads of 0 picks UNI_SETTINGS_LOAD_THREADS) and
+// merges them in list order, a key set by a later file overrides the earlier
+// value. ParseError() and ParseErrorFile() report the first file which failed.
+UniSettings(const std::vector<string>& filenames, size_t threads = 0) : _error(0) {
+    Layers layers(filenames);
+    if (threads == 0)
+        threads = UNI_SETTINGS_LOAD_THREADS;
+    if (threads > filenames.size())
+        threads = filenames.size();
+    if (threads <= 1) {
+        LoadLayers(&layers);
+    }
+    else {
+        ArrayPtr<UniThread> workers(new UniThread[threads]);
+        std::vector<char> started(threads, 0);
+        bool all = true;
+        for (size_t i = 0; i < threads; i++) {
+            started[i] = workers.get()[i].createNewThread(&UniSettings::LoadLayers, &layers, UniThreadOptions());
+            all = all && started[i];
+        }
+        // Files no worker took are loaded here
+        if (!all)
+            LoadLayers(&layers);
+        for (size_t i = 0; i < threads; i++)
+            if (started[i])
+                workers.get()[i].join();
+    }
+    for (size_t i = 0; i < filenames.size(); i++) {
+        int error = layers.items[i] ? layers.items[i]->_error : -2;
+        if (_error == 0 && error != 0) {
+            _error = error;
+            _errorFile = filenames[i];
+        }
+        if (layers.items[i])
+            _values.merge(layers.items[i]->_values);
+    }
+}
+
+// The "*.ini" (or other suffix) files of a conf.d style directory, sorted by
+// name, which is the override order for the layered constructor
+static std::vector<string> ListDirectory(const string& directory, const string& suffix = ".ini") {
+    std::vector<string> files;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((directory + "\\*" + suffix).c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                files.push_back(directory + "\\" + data.cFileName);
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    DIR* dir = opendir(directory.c_str());
+    if (dir) {
+        while (struct dirent* entry = readdir(dir)) {
+            string name = entry->d_name;
+            if (name.size() > suffix.size() && name[0] != '.' &&
+                name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+                files.push_back(directory + "/" + name);
+        }
+        closedir(dir);
+    }
+#endif
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// Parses INI text already in memory, data is not referenced after the call
+UniSettings(const char* data, size_t size) {
+    _error = priv::CReaderImplement::ini_parse_buffer(data, size, ViewHandler, this);
+    ConvertValues();
+}
+
+int ParseError() const {
     return _error;
 }
 
-string Get(string section, string name, string default_value) {
-    string key = MakeKey(section, name);
-    return _values.count(key) ? _values[key] : default_value;
+// File of the ParseError() of a layered load
+const string& ParseErrorFile() const {
+    return _errorFile;
 }
 
-long GetInteger(string section, string name, long default_value) {
-    string valstr = Get(section, name, "");
-    const char* value = valstr.c_str();
+// Writes the binary image, stamped with the size and time of sourceFile
+bool SaveImage(const string& imageFile, const string& sourceFile) const {
+    int64_t size, time;
+    if (!priv::CSettingsStore::stamp(sourceFile.c_str(), size, time))
+        return false;
+    return _values.save(imageFile.c_str(), _error, size, time);
+}
+
+// True when the values come from a mapped image
+bool FromImage() const {
+    return _values.mapped();
+}
+
+// Finds the value without allocating, the returned value is null terminated
+bool Lookup(const char* section, size_t sectionLen, const char* name, size_t nameLen,
+            const char*& value, size_t& valueLen) const {
+    uint32_t idx = _values.find(section, sectionLen, name, nameLen);
+    if (idx == priv::CSettingsStore::npos)
+        return false;
+    value = _values.value(idx);
+    valueLen = _values.entry(idx).valLen;
+    return true;
+}
+
+bool Lookup(const char* section, const char* name, const char*& value, size_t& valueLen) const {
+    return Lookup(section, strlen(section), name, strlen(name), value, valueLen);
+}
+
+string Get(const string& section, const string& name, const string& default_value) const {
+    const char* value;
+    size_t len;
+    if (!Lookup(section.data(), section.size(), name.data(), name.size(), value, len))
+        return default_value;
+    return string(value, len);
+}
+
+// Allocation free version of Get, the pointer stays valid as long as the object
+const char* GetString(const char* section, const char* name, const char* default_value) const {
+    const char* value;
+    size_t len;
+    return Lookup(section, name, value, len) ? value : default_value;
+}
+
+// Keys missing at the time of the call give an invalid handle, which always
+// returns the default value
+Handle Resolve(const char* section, const char* name) const {
+    return Handle(_values.find(section, strlen(section), name, strlen(name)));
+}
+
+Handle Resolve(const string& section, const string& name) const {
+    return Handle(_values.find(section.data(), section.size(), name.data(), name.size()));
+}
+
+Handle Resolve(const Key& key) const {
+    return Handle(_values.findKey(key._hash, key._key.data(), key._key.size()));
+}
+
+// False when the key is missing or its value is not a number/boolean. A number
+// outside the long range is not an integer, GetInteger() gives the default for it.
+bool TryInteger(const Handle& key, long& value) const {
+    if (!key.Valid() || !(_values.entry(key._index).typed & priv::CSettingsStore::TYPED_INTEGER))
+        return false;
+    value = static_cast<long>(_values.entry(key._index).integer);
+    return true;
+}
+
+bool TryBoolean(const Handle& key, bool& value) const {
+    if (!key.Valid())
+        return false;
+    uint32_t typed = _values.entry(key._index).typed;
+    if (!(typed & (priv::CSettingsStore::TYPED_TRUE | priv::CSettingsStore::TYPED_FALSE)))
+        return false;
+    value = (typed & priv::CSettingsStore::TYPED_TRUE) != 0;
+    return true;
+}
+
+const char* GetString(const Handle& key, const char* default_value) const {
+    return key.Valid() ? _values.value(key._index) : default_value;
+}
+
+string Get(const Handle& key, const string& default_value) const {
+    if (!key.Valid())
+        return default_value;
+    return string(_values.value(key._index), _values.entry(key._index).valLen);
+}
+
+long GetInteger(const Handle& key, long default_value) const {
+    if (!key.Valid())
+        return default_value;
+    const priv::CSettingsStore::Entry& e = _values.entry(key._index);
+    return (e.typed & priv::CSettingsStore::TYPED_INTEGER) ? static_cast<long>(e.integer) : default_value;
+}
+
+bool GetBoolean(const Handle& key, bool default_value) const {
+    if (!key.Valid())
+        return default_value;
+    const priv::CSettingsStore::Entry& e = _values.entry(key._index);
+    if (e.typed & priv::CSettingsStore::TYPED_TRUE)
+        return true;
+    else if (e.typed & priv::CSettingsStore::TYPED_FALSE)
+        return false;
+    else
+        return default_value;
+}
+
+long GetInteger(const char* section, const char* name, long default_value) const {
+    return GetInteger(Resolve(section, name), default_value);
+}
+
+long GetInteger(const string& section, const string& name, long default_value) const {
+    return GetInteger(section.c_str(), name.c_str(), default_value);
+}
+
+bool GetBoolean(const char* section, const char* name, bool default_value) const {
+    return GetBoolean(Resolve(section, name), default_value);
+}
+
+bool GetBoolean(const string& section, const string& name, bool default_value) const {
+    return GetBoolean(section.c_str(), name.c_str(), default_value);
+}
+
+static long ParseInteger(const char* value, long default_value) {
     char* end;
     // This parses "1234" (decimal) and also "0x4D2" (hex)
     long n = strtol(value, &end, 0);
     return end > value ? n : default_value;
 }
 
-bool GetBoolean(string section, string name, bool default_value) {
-    string valstr = Get(section, name, "");
-    // Convert to lower case to make string comparisons case-insensitive
-    std::transform(valstr.begin(), valstr.end(), valstr.begin(), ::tolower);
-    if (valstr == "true" || valstr == "yes" || valstr == "on" || valstr == "1")
+static bool ParseBoolean(const char* value, bool default_value) {
+    // String comparisons are case-insensitive
+    if (Equals(value, "true") || Equals(value, "yes") || Equals(value, "on") || Equals(value, "1"))
         return true;
-    else if (valstr == "false" || valstr == "no" || valstr == "off" || valstr == "0")
+    else if (Equals(value, "false") || Equals(value, "no") || Equals(value, "off") || Equals(value, "0"))
         return false;
     else
         return default_value;
 }
 
-static string MakeKey(string section, string name) {
+static string MakeKey(const string& section, const string& name) {
     string key = section + "." + name;
-    // Convert to lower case to make section/name lookups case-insensitive
-    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    // Convert to lower case to make section/name lookups case-insensitive, ASCII
+    // only like the store, so a Key finds the same entry under any locale
+    std::transform(key.begin(), key.end(), key.begin(), priv::CSettingsStore::lower);
     return key;
 }
 
 static int ValueHandler(void* user, const char* section, const char* name,
                             const char* value) {
     UniSettings* reader = (UniSettings*)user;
-    string key = MakeKey(section, name);
-    if (reader->_values[key].size() > 0)
-        reader->_values[key] += "\n";
-    reader->_values[key] += value;
+    reader->_values.add(section, strlen(section), name, strlen(name), value, strlen(value));
     return 1;
 }
 
+static int ViewHandler(void* user, const char* section, size_t sectionLen,
+                       const char* name, size_t nameLen, const char* value, size_t valueLen) {
+    UniSettings* reader = (UniSettings*)user;
+    reader->_values.add(section, sectionLen, name, nameLen, value, valueLen);
+    return 1;
+}
+
+private:
+// Per-file results of a layered load, workers take the next file from next
+struct Layers {
+    Layers(const std::vector<string>& names) : files(names), items(names.size(), (UniSettings*)NULL), next(0) {}
+    ~Layers() {
+        for (size_t i = 0; i < items.size(); i++)
+            delete items[i];
+    }
+    const std::vector<string>& files;
+    std::vector<UniSettings*> items;
+    volatile size_t next;
+};
+
+static void* LoadLayers(void* arg) {
+    Layers* layers = (Layers*)arg;
+    for (;;) {
+        size_t i = UniAtomic::fetchAdd(&layers->next, (size_t)1);
+        if (i >= layers->files.size())
+            break;
+        try {
+            layers->items[i] = new UniSettings(layers->files[i]);
+        }
+        catch (...) {
+            /* Left NULL, reported as an allocation error */
+        }
+    }
+    return NULL;
+}
+
+// Converts every value to its integer and boolean form once, after parsing
+void ConvertValues() {
+    for (uint32_t i = 0; i < _values.size(); i++) {
+        priv::CSettingsStore::Entry& e = _values.entry(i);
+        const char* value = _values.value(i);
+        char* end;
+        errno = 0;
+        long n = strtol(value, &end, 0);
+        e.typed = 0;
+        // A number out of the long range is not an integer
+        if (end > value && errno != ERANGE) {
+            e.typed |= priv::CSettingsStore::TYPED_INTEGER;
+            e.integer = n;
+        }
+        if (ParseBoolean(value, false))
+            e.typed |= priv::CSettingsStore::TYPED_TRUE;
+        else if (!ParseBoolean(value, true))
+            e.typed |= priv::CSettingsStore::TYPED_FALSE;
+    }
+}
+
+// Case-insensitive comparison with a lowercase word
+static bool Equals(const char* value, const char* word) {
+    for (; *word; ++value, ++word)
+        if (priv::CSettingsStore::lower(*value) != *word)
+            return false;
+    return *value == '\0';
+}
+
 private:
     int _error;
-    std::map<std::string, std::string> _values;
+    string _errorFile;
+    priv::CSettingsStore _values;
 };
 
 
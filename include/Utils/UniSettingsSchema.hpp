@@ -0,0 +1,168 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_SETTINGS_SCHEMA_HPP
+#define _UNI_SETTINGS_SCHEMA_HPP
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include "UniSettings.h"
+#include "ArrayPtr.hpp"
+
+namespace utils {
+
+//Keys which could not be bound, as lowercased "section.name"
+struct UniSettingsReport {
+    //Required keys missing from the settings
+    std::vector<std::string> missing;
+    //Keys whose value does not convert to the field type
+    std::vector<std::string> invalid;
+    bool Ok() const {
+        return missing.empty() && invalid.empty();
+    }
+};
+
+//Maps section/name pairs to the fields of T. Keys are hashed once, when the schema
+//is built, so Bind() costs one index probe per field:
+//
+//  static const UniSettingsSchema<Config> schema = UniSettingsSchema<Config>()
+//      .Field("server", "port", &Config::port, 80L)
+//      .Field("server", "name", &Config::name, "localhost", true);
+//  UniSettingsReport report = schema.Bind(settings, config);
+//
+//Supported field types: std::string, bool, int, long, unsigned, unsigned long,
+//float and double. Missing or invalid keys leave the default in the field, a value
+//outside the range of the field type is invalid.
+template<typename T>
+class UniSettingsSchema {
+public:
+    template<typename M, typename D>
+    UniSettingsSchema &Field(const std::string &section, const std::string &name, M T::*member,
+                             const D &defaultValue, bool required = false) {
+        mFields.push_back(FieldPtr(new FieldImpl<M>(section, name, member, M(defaultValue), required)));
+        return *this;
+    }
+
+    UniSettingsReport Bind(const UniSettings &settings, T &target) const {
+        UniSettingsReport report;
+        for(std::size_t i = 0; i < mFields.size(); ++i)
+            mFields[i]->bind(settings, target, report);
+        return report;
+    }
+
+private:
+    struct FieldBase {
+        FieldBase(const std::string &section, const std::string &name, bool isRequired)
+            : key(section, name), required(isRequired) {}
+        virtual ~FieldBase() {}
+        virtual void bind(const UniSettings &settings, T &target, UniSettingsReport &report) const = 0;
+        UniSettings::Key key;
+        bool required;
+    };
+
+    template<typename M>
+    struct FieldImpl : public FieldBase {
+        FieldImpl(const std::string &section, const std::string &name, M T::*field, const M &value, bool isRequired)
+            : FieldBase(section, name, isRequired), member(field), defaultValue(value) {}
+        void bind(const UniSettings &settings, T &target, UniSettingsReport &report) const {
+            UniSettings::Handle handle = settings.Resolve(this->key);
+            target.*member = defaultValue;
+            if(!handle.Valid()) {
+                if(this->required)
+                    report.missing.push_back(this->key.Name());
+            }
+            else if(!convert(settings, handle, target.*member)) {
+                report.invalid.push_back(this->key.Name());
+            }
+        }
+        M T::*member;
+        M defaultValue;
+    };
+
+    typedef std::tr1::shared_ptr<FieldBase> FieldPtr;
+
+    static bool convert(const UniSettings &settings, const UniSettings::Handle &handle, std::string &value) {
+        value = settings.Get(handle, value);
+        return true;
+    }
+    static bool convert(const UniSettings &settings, const UniSettings::Handle &handle, bool &value) {
+        return settings.TryBoolean(handle, value);
+    }
+    static bool convert(const UniSettings &settings, const UniSettings::Handle &handle, long &value) {
+        return settings.TryInteger(handle, value);
+    }
+    //Whether n fits M, negative values never fit an unsigned M
+    template<typename M>
+    static bool fits(long n) {
+        if(n < 0)
+            return std::numeric_limits<M>::is_signed && n >= static_cast<long>(std::numeric_limits<M>::min());
+        return static_cast<unsigned long>(n) <= static_cast<unsigned long>(std::numeric_limits<M>::max());
+    }
+    static bool convert(const UniSettings &settings, const UniSettings::Handle &handle, int &value) {
+        long n;
+        if(!settings.TryInteger(handle, n) || !fits<int>(n))
+            return false;
+        value = static_cast<int>(n);
+        return true;
+    }
+    static bool convert(const UniSettings &settings, const UniSettings::Handle &handle, unsigned &value) {
+        long n;
+        if(!settings.TryInteger(handle, n) || !fits<unsigned>(n))
+            return false;
+        value = static_cast<unsigned>(n);
+        return true;
+    }
+    static bool convert(const UniSettings &settings, const UniSettings::Handle &handle, unsigned long &value) {
+        long n;
+        if(!settings.TryInteger(handle, n) || !fits<unsigned long>(n))
+            return false;
+        value = static_cast<unsigned long>(n);
+        return true;
+    }
+    static bool convert(const UniSettings &settings, const UniSettings::Handle &handle, double &value) {
+        const char *text = settings.GetString(handle, "");
+        char *end;
+        errno = 0;
+        double n = strtod(text, &end);
+        //Overflow is out of range like for the integers, underflow only loses precision
+        if(end == text || (errno == ERANGE && (n == HUGE_VAL || n == -HUGE_VAL)))
+            return false;
+        value = n;
+        return true;
+    }
+    static bool convert(const UniSettings &settings, const UniSettings::Handle &handle, float &value) {
+        double n;
+        if(!convert(settings, handle, n))
+            return false;
+        if(n > std::numeric_limits<float>::max() && n <= std::numeric_limits<double>::max())
+            return false;
+        if(n < -std::numeric_limits<float>::max() && n >= -std::numeric_limits<double>::max())
+            return false;
+        value = static_cast<float>(n);
+        return true;
+    }
+
+private:
+    std::vector<FieldPtr> mFields;
+};
+
+}//namespace utils
+
+#endif
@@ -0,0 +1,481 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_TASK_SCHEDULER_HPP
+#define _UNI_TASK_SCHEDULER_HPP
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <exception>
+#include "UniThread.hpp"
+#include "UniMutex.hpp"
+#include "UniAtomic.hpp"
+#include "ArrayPtr.hpp"
+#include "UniException.h"
+
+//Initial capacity of a worker deque, it grows by doubling
+#ifndef UNI_TASK_DEQUE_SIZE
+#define UNI_TASK_DEQUE_SIZE 256
+#endif
+
+namespace utils {
+
+class UniTaskGroup;
+class UniTaskScheduler;
+
+namespace priv {
+
+class StealTask {
+public:
+    explicit StealTask(UniTaskGroup *group) : mGroup(group) {}
+    virtual ~StealTask() {}
+    virtual void execute() = 0;
+    //Runs the task, reports to its group and deletes it
+    inline void run();
+private:
+    UniTaskGroup *mGroup;
+};
+
+template<typename F>
+class StealFunctor : public StealTask {
+public:
+    StealFunctor(UniTaskGroup *group, const F &func) : StealTask(group), mFunc(func) {}
+    void execute() {
+        mFunc();
+    }
+private:
+    F mFunc;
+};
+
+//Chase-Lev deque (Le, Pop, Cohen, Zappa Nardelli, "Correct and Efficient
+//Work-Stealing for Weak Memory Models"). The owner pushes and takes at the bottom,
+//other threads steal from the top. Arrays replaced by growth are kept until the
+//deque is destroyed, as a thief may still be reading one.
+class StealDeque {
+public:
+    StealDeque() : mTop(0), mBottom(0), mArray(NULL) {
+        Array *a = new Array(UNI_TASK_DEQUE_SIZE);
+        mRetired.push_back(a);
+        mArray = a;
+    }
+    ~StealDeque() {
+        for(std::size_t i = 0; i < mRetired.size(); ++i)
+            delete mRetired[i];
+    }
+    //Owner only
+    void push(StealTask *task) {
+        long b = UniAtomic::loadRelaxed(&mBottom);
+        long t = UniAtomic::loadAcquire(&mTop);
+        Array *a = UniAtomic::loadRelaxed(&mArray);
+        if(b - t > a->mask) {
+            a = a->grow(t, b);
+            mRetired.push_back(a);
+            UniAtomic::storeRelease(&mArray, a);
+        }
+        a->put(b, task);
+        UniAtomic::storeRelease(&mBottom, b + 1);
+    }
+    //Owner only, NULL when empty
+    StealTask *take() {
+        long b = UniAtomic::loadRelaxed(&mBottom) - 1;
+        Array *a = UniAtomic::loadRelaxed(&mArray);
+        UniAtomic::storeRelaxed(&mBottom, b);
+        UniAtomic::fence();
+        long t = UniAtomic::loadRelaxed(&mTop);
+        if(t > b) {
+            UniAtomic::storeRelaxed(&mBottom, b + 1);
+            return NULL;
+        }
+        StealTask *task = a->get(b);
+        if(t == b) {
+            //Last task, race the thieves for it
+            if(!UniAtomic::compareExchange(&mTop, t, t + 1))
+                task = NULL;
+            UniAtomic::storeRelaxed(&mBottom, b + 1);
+        }
+        return task;
+    }
+    //Any thread, NULL when empty or when another thread won the race
+    StealTask *steal() {
+        long t = UniAtomic::loadAcquire(&mTop);
+        UniAtomic::fence();
+        long b = UniAtomic::loadAcquire(&mBottom);
+        if(t >= b)
+            return NULL;
+        Array *a = UniAtomic::loadAcquire(&mArray);
+        StealTask *task = a->get(t);
+        if(!UniAtomic::compareExchange(&mTop, t, t + 1))
+            return NULL;
+        return task;
+    }
+private:
+    struct Array {
+        explicit Array(long size) : mask(size - 1), items(new StealTask *volatile[size]) {}
+        ~Array() {
+            delete [] items;
+        }
+        StealTask *get(long i) const {
+            return UniAtomic::loadRelaxed(&items[i & mask]);
+        }
+        void put(long i, StealTask *task) {
+            UniAtomic::storeRelaxed(&items[i & mask], task);
+        }
+        Array *grow(long top, long bottom) const {
+            Array *a = new Array((mask + 1) * 2);
+            for(long i = top; i < bottom; ++i)
+                a->put(i, get(i));
+            return a;
+        }
+        long mask;
+        StealTask *volatile *items;
+    };
+    StealDeque(StealDeque &);
+    StealDeque &operator=(const StealDeque &other);
+private:
+    //top and bottom on separate cache lines, thieves hammer the first
+    volatile long mTop;
+    char mPad[64 - sizeof(long)];
+    volatile long mBottom;
+    Array *volatile mArray;
+    std::vector<Array *> mRetired;
+};
+
+}//namespace priv
+
+//Fork/join task scheduler. Every worker owns a Chase-Lev deque; tasks spawned on a
+//worker go to its own deque (newest first, good for cache locality), idle workers
+//steal the oldest tasks of random victims. Tasks spawned from other threads go
+//through a shared injection queue. All workers are created with the same options.
+class UniTaskScheduler {
+public:
+    explicit UniTaskScheduler(std::size_t threads, const UniThreadOptions &options = UniThreadOptions());
+    ~UniTaskScheduler();
+
+    std::size_t size() const {
+        return mSize;
+    }
+
+private:
+    friend class UniTaskGroup;
+    struct Worker {
+        UniTaskScheduler *scheduler;
+        std::size_t index;
+        unsigned long random;
+        priv::StealDeque deque;
+    };
+    UniTaskScheduler(UniTaskScheduler &);
+    UniTaskScheduler &operator=(const UniTaskScheduler &other);
+
+    void spawn(priv::StealTask *task);
+    //Stops the workers and joins the first started threads
+    void stop(std::size_t started);
+    //Some task from anywhere but the own deque, NULL if there is none
+    priv::StealTask *find(Worker *self);
+    void wake();
+    //Wakes threads outside the scheduler waiting in UniTaskGroup::sync()
+    void groupDone();
+    static Worker *&current() {
+        static UNI_THREAD_LOCAL Worker *worker = NULL;
+        return worker;
+    }
+    static void *work(void *arg);
+
+private:
+    std::size_t mSize;
+    ArrayPtr<Worker> mWorkers;
+    ArrayPtr<UniThread> mThreads;
+    UniMutex mInjectLock;
+    std::deque<priv::StealTask *> mInjected;
+    volatile long mInjectedCount;
+    //Eventcount of sleeping workers, bumped by spawn() only when someone sleeps
+    UniMutex mSleepLock;
+    UniCondition mSleep;
+    volatile long mSleepers;
+    volatile long mEpoch;
+    //Same for the outside threads
+    UniMutex mDoneLock;
+    UniCondition mDone;
+    volatile long mWaiters;
+    volatile long mDoneEpoch;
+    volatile int mStop;
+};
+
+//Tasks spawned through a group are waited for by its sync(). Waiting workers run
+//pending tasks meanwhile, so recursive spawn/sync does not block them; other threads
+//leave the tasks to the workers and sleep.
+//The first exception thrown by a task is rethrown by sync() as UniException.
+class UniTaskGroup {
+public:
+    explicit UniTaskGroup(UniTaskScheduler &scheduler) : mScheduler(scheduler), mPending(0), mFailed(0) {}
+    ~UniTaskGroup() {
+        wait();
+    }
+
+    //func is copied, it takes no arguments and its result is ignored
+    template<typename F>
+    void spawn(const F &func) {
+        UniAtomic::fetchAdd(&mPending, 1L);
+        mScheduler.spawn(new priv::StealFunctor<F>(this, func));
+    }
+
+    void sync() {
+        wait();
+        if(UniAtomic::load(&mFailed)) {
+            std::string error = mError;
+            mError.clear();
+            UniAtomic::store(&mFailed, 0);
+            throw UniException("Task failed ", error);
+        }
+    }
+
+private:
+    friend class priv::StealTask;
+    UniTaskGroup(UniTaskGroup &);
+    UniTaskGroup &operator=(const UniTaskGroup &other);
+
+    inline void wait();
+    void finished(const char *error) {
+        if(error) {
+            int expected = 0;
+            if(UniAtomic::compareExchange(&mFailed, expected, 2)) {
+                mError = error;
+                UniAtomic::store(&mFailed, 1);
+            }
+        }
+        //The group may be gone as soon as the count drops to zero
+        UniTaskScheduler &scheduler = mScheduler;
+        if(UniAtomic::fetchAdd(&mPending, -1L) == 1)
+            scheduler.groupDone();
+    }
+
+private:
+    UniTaskScheduler &mScheduler;
+    volatile long mPending;
+    //0 no error, 2 while the first error is being stored, 1 stored
+    volatile int mFailed;
+    std::string mError;
+};
+
+inline
+void priv::StealTask::run() {
+    UniTaskGroup *group = mGroup;
+    std::string error;
+    bool failed = false;
+    try {
+        execute();
+    }
+    catch (std::exception &e) {
+        error = e.what();
+        failed = true;
+    }
+    catch (...) {
+        error = "unknown exception";
+        failed = true;
+    }
+    delete this;
+    group->finished(failed ? error.c_str() : NULL);
+}
+
+inline
+UniTaskScheduler::UniTaskScheduler(std::size_t threads, const UniThreadOptions &options)
+    : mSize(threads ? threads : 1), mWorkers(new Worker[threads ? threads : 1]),
+      mThreads(new UniThread[threads ? threads : 1]),
+      mInjectedCount(0), mSleepers(0), mEpoch(0), mWaiters(0), mDoneEpoch(0), mStop(0) {
+    for(std::size_t i = 0; i < mSize; ++i) {
+        Worker &w = mWorkers.get()[i];
+        w.scheduler = this;
+        w.index = i;
+        w.random = 2654435761ul * (i + 1);
+    }
+    for(std::size_t i = 0; i < mSize; ++i) {
+        if(!mThreads.get()[i].createNewThread(&UniTaskScheduler::work, &mWorkers.get()[i], options)) {
+            stop(i);
+            throw UniException("Cannot start scheduler thread");
+        }
+    }
+}
+
+//Groups have to be synced before the scheduler goes away
+inline
+UniTaskScheduler::~UniTaskScheduler() {
+    stop(mSize);
+}
+
+inline
+void UniTaskScheduler::stop(std::size_t started) {
+    {
+        UniScopedLock lock(mSleepLock);
+        UniAtomic::store(&mStop, 1);
+        UniAtomic::fetchAdd(&mEpoch, 1L);
+    }
+    mSleep.broadcast();
+    for(std::size_t i = 0; i < started; ++i)
+        mThreads.get()[i].join();
+}
+
+inline
+void UniTaskScheduler::spawn(priv::StealTask *task) {
+    Worker *self = current();
+    if(self && self->scheduler == this) {
+        self->deque.push(task);
+    }
+    else {
+        UniScopedLock lock(mInjectLock);
+        mInjected.push_back(task);
+        UniAtomic::fetchAdd(&mInjectedCount, 1L);
+    }
+    //Pairs with the fence of a worker going to sleep, one of the two sees the other
+    UniAtomic::fence();
+    if(UniAtomic::loadRelaxed(&mSleepers) != 0)
+        wake();
+}
+
+inline
+void UniTaskScheduler::wake() {
+    {
+        UniScopedLock lock(mSleepLock);
+        UniAtomic::fetchAdd(&mEpoch, 1L);
+    }
+    mSleep.signal();
+}
+
+inline
+void UniTaskScheduler::groupDone() {
+    UniAtomic::fence();
+    if(UniAtomic::loadRelaxed(&mWaiters) == 0)
+        return;
+    {
+        UniScopedLock lock(mDoneLock);
+        UniAtomic::fetchAdd(&mDoneEpoch, 1L);
+    }
+    mDone.broadcast();
+}
+
+inline
+priv::StealTask *UniTaskScheduler::find(Worker *self) {
+    if(UniAtomic::loadRelaxed(&mInjectedCount) != 0) {
+        UniScopedLock lock(mInjectLock);
+        if(!mInjected.empty()) {
+            priv::StealTask *task = mInjected.front();
+            mInjected.pop_front();
+            UniAtomic::fetchAdd(&mInjectedCount, -1L);
+            return task;
+        }
+    }
+    //xorshift, starting at a random victim and trying each once
+    std::size_t start = 0;
+    if(self) {
+        unsigned long x = self->random;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        self->random = x;
+        start = static_cast<std::size_t>(x % mSize);
+    }
+    for(std::size_t i = 0; i < mSize; ++i) {
+        Worker &victim = mWorkers.get()[(start + i) % mSize];
+        if(&victim == self)
+            continue;
+        priv::StealTask *task = victim.deque.steal();
+        if(task)
+            return task;
+    }
+    return NULL;
+}
+
+inline
+void *UniTaskScheduler::work(void *arg) {
+    Worker *self = static_cast<Worker *>(arg);
+    UniTaskScheduler *scheduler = self->scheduler;
+    current() = self;
+    unsigned idle = 0;
+    while(!UniAtomic::load(&scheduler->mStop)) {
+        priv::StealTask *task = self->deque.take();
+        if(!task)
+            task = scheduler->find(self);
+        if(task) {
+            task->run();
+            idle = 0;
+            continue;
+        }
+        if(++idle < 64) {
+            UniAtomic::pause();
+            continue;
+        }
+        //Announce the sleep, look once more, then wait for an epoch change
+        UniAtomic::fetchAdd(&scheduler->mSleepers, 1L);
+        long epoch = UniAtomic::load(&scheduler->mEpoch);
+        task = scheduler->find(self);
+        if(task) {
+            UniAtomic::fetchAdd(&scheduler->mSleepers, -1L);
+            task->run();
+            idle = 0;
+            continue;
+        }
+        {
+            UniScopedLock lock(scheduler->mSleepLock);
+            while(UniAtomic::load(&scheduler->mEpoch) == epoch)
+                scheduler->mSleep.wait(scheduler->mSleepLock);
+        }
+        UniAtomic::fetchAdd(&scheduler->mSleepers, -1L);
+        idle = 0;
+    }
+    current() = NULL;
+    return NULL;
+}
+
+inline
+void UniTaskGroup::wait() {
+    UniTaskScheduler::Worker *self = UniTaskScheduler::current();
+    if(!self || self->scheduler != &mScheduler) {
+        //Running tasks here would put everything they spawn in the injection queue
+        for(unsigned idle = 0; UniAtomic::load(&mPending) != 0; ) {
+            if(++idle < 64) {
+                UniAtomic::pause();
+                continue;
+            }
+            UniAtomic::fetchAdd(&mScheduler.mWaiters, 1L);
+            long epoch = UniAtomic::load(&mScheduler.mDoneEpoch);
+            if(UniAtomic::load(&mPending) != 0) {
+                UniScopedLock lock(mScheduler.mDoneLock);
+                while(UniAtomic::load(&mScheduler.mDoneEpoch) == epoch)
+                    mScheduler.mDone.wait(mScheduler.mDoneLock);
+            }
+            UniAtomic::fetchAdd(&mScheduler.mWaiters, -1L);
+        }
+        return;
+    }
+    for(unsigned idle = 0; UniAtomic::load(&mPending) != 0; ) {
+        priv::StealTask *task = self->deque.take();
+        if(!task)
+            task = mScheduler.find(self);
+        if(task) {
+            task->run();
+            idle = 0;
+        }
+        else if(++idle < 64) {
+            UniAtomic::pause();
+        }
+        else {
+            UniAtomic::yield();
+        }
+    }
+}
+
+}//namespace utils
+
+#endif
@@ -32,12 +32,110 @@
 #define USE_POSIX_PTHREAD
 #endif
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#endif
+
+#include <string>
+#include <vector>
+
+//Thread local storage for plain data, also before C++11
+#if defined(_MSC_VER)
+#define UNI_THREAD_LOCAL __declspec(thread)
+#else
+#define UNI_THREAD_LOCAL __thread
 #endif
 
 namespace utils {
 
 typedef  void* (*vvfunction)(void*);
 
+//Creation options of UniThread, the defaults give a plain thread. Options the
+//platform does not support are ignored.
+struct UniThreadOptions {
+    UniThreadOptions() : stackSize(0), numaNode(-1), numaStrict(false), policy(-1), priority(0) {}
+    //Shown by top and perf, Linux keeps the first 15 characters
+    std::string name;
+    //0 for the default
+    std::size_t stackSize;
+    //CPUs the thread may run on, empty for any (or the CPUs of numaNode)
+    std::vector<int> cpus;
+    //Node memory of the thread is allocated from, -1 for the system policy.
+    //Only preferred unless numaStrict, which fails allocations the node can not satisfy.
+    int numaNode;
+    bool numaStrict;
+    //SCHED_FIFO, SCHED_RR... with its priority, -1 to inherit
+    int policy;
+    int priority;
+};
+
+namespace priv {
+
+#ifdef __linux__
+//Runs in the new thread and applies what can not be set through pthread_attr_t
+struct ThreadStart {
+    vvfunction func;
+    void *arg;
+    std::string name;
+    int numaNode;
+    bool numaStrict;
+
+    static void *run(void *start) {
+        ThreadStart *self = static_cast<ThreadStart *>(start);
+        vvfunction func = self->func;
+        void *arg = self->arg;
+        if(!self->name.empty())
+            prctl(PR_SET_NAME, self->name.substr(0, 15).c_str(), 0, 0, 0);
+        if(self->numaNode >= 0)
+            bindMemory(self->numaNode, self->numaStrict);
+        delete self;
+        return func(arg);
+    }
+
+    //set_mempolicy through syscall, so libnuma is not needed
+    static void bindMemory(int node, bool strict) {
+        const int MPOL_PREFERRED_MODE = 1;
+        const int MPOL_BIND_MODE = 2;
+        const std::size_t bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask(node / bits + 1, 0);
+        mask[node / bits] = 1ul << (node % bits);
+        syscall(SYS_set_mempolicy, strict ? MPOL_BIND_MODE : MPOL_PREFERRED_MODE,
+                &mask[0], static_cast<unsigned long>(mask.size() * bits + 1));
+    }
+};
+
+//CPUs of a NUMA node from sysfs, cpulist is like "0-7,16-23"
+inline std::vector<int> numaNodeCpus(int node) {
+    std::vector<int> cpus;
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if(!file)
+        return cpus;
+    int first, last;
+    while(fscanf(file, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(file);
+        if(c == '-') {
+            if(fscanf(file, "%d", &last) != 1)
+                break;
+            c = fgetc(file);
+        }
+        for(int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+        if(c != ',')
+            break;
+    }
+    fclose(file);
+    return cpus;
+}
+#endif
+
+}//namespace priv
+
 #ifdef USE_POSIX_PTHREAD
 class UniThread {
 public:
@@ -47,6 +145,12 @@ public:
     void createNewThread(vvfunction func, TH_ARG_THIS args) {
         pthread_create(&mT, NULL, func, reinterpret_cast<void*>(args));
     }
+    //Returns false if the thread could not be started, e.g. a real time policy
+    //without the privilege for it
+    template<typename TH_ARG_THIS>
+    bool createNewThread(vvfunction func, TH_ARG_THIS args, const UniThreadOptions &options) {
+        return start(func, reinterpret_cast<void*>(args), options);
+    }
     void join() {
         pthread_join(mT, NULL);
     }
@@ -56,10 +160,53 @@ public:
 private:
     UniThread(UniThread &);
     UniThread &operator=(const UniThread &other);
+    inline bool start(vvfunction func, void *arg, const UniThreadOptions &options);
 private:
     pthread_t mT;
 };
 
+inline
+bool UniThread::start(vvfunction func, void *arg, const UniThreadOptions &options) {
+    pthread_attr_t attr;
+    if(pthread_attr_init(&attr) != 0)
+        return false;
+    if(options.stackSize)
+        pthread_attr_setstacksize(&attr, options.stackSize);
+    if(options.policy >= 0) {
+        sched_param param;
+        param.sched_priority = options.priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, options.policy);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+#ifdef __linux__
+    std::vector<int> cpus = options.cpus;
+    if(cpus.empty() && options.numaNode >= 0)
+        cpus = priv::numaNodeCpus(options.numaNode);
+    if(!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(std::size_t i = 0; i < cpus.size(); ++i)
+            if(cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+                CPU_SET(cpus[i], &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    priv::ThreadStart *trampoline = new priv::ThreadStart();
+    trampoline->func = func;
+    trampoline->arg = arg;
+    trampoline->name = options.name;
+    trampoline->numaNode = options.numaNode;
+    trampoline->numaStrict = options.numaStrict;
+    int result = pthread_create(&mT, &attr, &priv::ThreadStart::run, trampoline);
+    if(result != 0)
+        delete trampoline;
+#else
+    int result = pthread_create(&mT, &attr, func, arg);
+#endif
+    pthread_attr_destroy(&attr);
+    return result == 0;
+}
+
 #else
 class UniThread {
 public:
@@ -69,6 +216,23 @@ public:
     void createNewThread(vvfunction func, TH_ARG_THIS args) {
         mT = boost::thread(func, reinterpret_cast<void*>(args));
     }
+    //Boost threads take the stack size and, on Windows, the CPU mask
+    template<typename TH_ARG_THIS>
+    bool createNewThread(vvfunction func, TH_ARG_THIS args, const UniThreadOptions &options) {
+        boost::thread::attributes attrs;
+        if(options.stackSize)
+            attrs.set_stack_size(options.stackSize);
+        mT = boost::thread(attrs, boost::bind(func, reinterpret_cast<void*>(args)));
+#ifdef _WIN32
+        DWORD_PTR mask = 0;
+        for(std::size_t i = 0; i < options.cpus.size(); ++i)
+            if(options.cpus[i] >= 0 && options.cpus[i] < static_cast<int>(8 * sizeof(mask)))
+                mask |= static_cast<DWORD_PTR>(1) << options.cpus[i];
+        if(mask)
+            SetThreadAffinityMask(mT.native_handle(), mask);
+#endif
+        return mT.joinable();
+    }
     void join() {
         mT.join();
     }
@@ -0,0 +1,346 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_THREAD_POOL_HPP
+#define _UNI_THREAD_POOL_HPP
+
+#include <deque>
+#include <string>
+#include <exception>
+#if __cplusplus >= 201103L
+#include <utility>
+#endif
+#include "UniThread.hpp"
+#include "UniMutex.hpp"
+#include "ArrayPtr.hpp"
+#include "UniException.h"
+
+namespace utils {
+
+//Result type of a task: F::result_type for C++98 functors, the call result with C++11.
+//Specialize it for functors which have neither.
+template<typename F>
+struct UniTaskResult {
+#if __cplusplus >= 201103L
+    typedef decltype(std::declval<F &>()()) type;
+#else
+    typedef typename F::result_type type;
+#endif
+};
+
+template<typename R>
+struct UniTaskResult<R (*)()> {
+    typedef R type;
+};
+
+template<typename R>
+struct UniTaskResult<R ()> {
+    typedef R type;
+};
+
+namespace priv {
+
+//Completion state shared by a task and its futures
+class FutureState {
+public:
+    FutureState() : mDone(false) {}
+    virtual ~FutureState() {}
+    void wait() {
+        UniScopedLock lock(mMutex);
+        while(!mDone)
+            mCondition.wait(mMutex);
+    }
+    bool ready() {
+        UniScopedLock lock(mMutex);
+        return mDone;
+    }
+    void finish(const std::string &error) {
+        UniScopedLock lock(mMutex);
+        mError = error;
+        mDone = true;
+        mCondition.broadcast();
+    }
+    //Waits and throws UniException if the task failed
+    void check() {
+        wait();
+        if(!mError.empty())
+            throw UniException("Task failed ", mError);
+    }
+private:
+    UniMutex mMutex;
+    UniCondition mCondition;
+    bool mDone;
+    std::string mError;
+};
+
+template<typename R>
+class ValueState : public FutureState {
+public:
+    ValueState() : mValue(NULL) {}
+    ~ValueState() {
+        delete mValue;
+    }
+    //Called by the task before finish()
+    void set(const R &value) {
+        mValue = new R(value);
+    }
+    const R &get() {
+        check();
+        return *mValue;
+    }
+private:
+    R *mValue;
+};
+
+template<>
+class ValueState<void> : public FutureState {
+public:
+    void get() {
+        check();
+    }
+};
+
+class PoolTask {
+public:
+    virtual ~PoolTask() {}
+    virtual void run() = 0;
+};
+
+template<typename F, typename R>
+class FunctorTask : public PoolTask {
+public:
+    FunctorTask(const F &func, const std::tr1::shared_ptr< ValueState<R> > &state) : mFunc(func), mState(state) {}
+    void run() {
+        std::string error;
+        try {
+            mState->set(mFunc());
+        }
+        catch (std::exception &e) {
+            error = e.what();
+        }
+        catch (...) {
+            error = "unknown exception";
+        }
+        mState->finish(error);
+    }
+private:
+    F mFunc;
+    std::tr1::shared_ptr< ValueState<R> > mState;
+};
+
+template<typename F>
+class FunctorTask<F, void> : public PoolTask {
+public:
+    FunctorTask(const F &func, const std::tr1::shared_ptr< ValueState<void> > &state) : mFunc(func), mState(state) {}
+    void run() {
+        std::string error;
+        try {
+            mFunc();
+        }
+        catch (std::exception &e) {
+            error = e.what();
+        }
+        catch (...) {
+            error = "unknown exception";
+        }
+        mState->finish(error);
+    }
+private:
+    F mFunc;
+    std::tr1::shared_ptr< ValueState<void> > mState;
+};
+
+//Adapts the UniThread style function
+struct ThreadFunctionCall {
+    typedef void *result_type;
+    ThreadFunctionCall(vvfunction f, void *a) : func(f), arg(a) {}
+    void *operator()() const {
+        return func(arg);
+    }
+    vvfunction func;
+    void *arg;
+};
+
+}//namespace priv
+
+//Result of a submitted task. Copies share the same result; get() waits for the task
+//and rethrows its failure as UniException.
+template<typename R>
+class UniFuture {
+public:
+    UniFuture() {}
+    explicit UniFuture(const std::tr1::shared_ptr< priv::ValueState<R> > &state) : mState(state) {}
+    bool valid() const {
+        return mState.get() != NULL;
+    }
+    bool ready() const {
+        return mState->ready();
+    }
+    void wait() const {
+        mState->wait();
+    }
+    const R &get() const {
+        return mState->get();
+    }
+private:
+    std::tr1::shared_ptr< priv::ValueState<R> > mState;
+};
+
+template<>
+class UniFuture<void> {
+public:
+    UniFuture() {}
+    explicit UniFuture(const std::tr1::shared_ptr< priv::ValueState<void> > &state) : mState(state) {}
+    bool valid() const {
+        return mState.get() != NULL;
+    }
+    bool ready() const {
+        return mState->ready();
+    }
+    void wait() const {
+        mState->wait();
+    }
+    void get() const {
+        mState->get();
+    }
+private:
+    std::tr1::shared_ptr< priv::ValueState<void> > mState;
+};
+
+//Fixed set of worker threads taking tasks from one queue in submission order.
+//shutdown() (and the destructor) runs the tasks already queued, then joins.
+//All workers are created with the same options, e.g. pinned to the CPUs of one node.
+class UniThreadPool {
+public:
+    explicit UniThreadPool(std::size_t threads, const UniThreadOptions &options = UniThreadOptions());
+    ~UniThreadPool();
+
+    //Queues a copy of func, a functor or function pointer taking no arguments
+    template<typename F>
+    UniFuture<typename UniTaskResult<F>::type> submit(const F &func);
+    //A function name would make F a function type, it is taken as a pointer here
+    template<typename R>
+    UniFuture<R> submit(R (*func)());
+
+    //Queues a UniThread style function
+    UniFuture<void *> submit(vvfunction func, void *arg) {
+        return submit(priv::ThreadFunctionCall(func, arg));
+    }
+
+    void shutdown();
+
+    std::size_t size() const {
+        return mSize;
+    }
+
+private:
+    UniThreadPool(UniThreadPool &);
+    UniThreadPool &operator=(const UniThreadPool &other);
+
+    void push(priv::PoolTask *task);
+    static void *work(void *arg);
+
+private:
+    std::size_t mSize;
+    ArrayPtr<UniThread> mThreads;
+    std::deque<priv::PoolTask *> mQueue;
+    UniMutex mMutex;
+    UniCondition mCondition;
+    bool mStopping;
+};
+
+inline
+UniThreadPool::UniThreadPool(std::size_t threads, const UniThreadOptions &options)
+    : mSize(threads ? threads : 1), mThreads(new UniThread[threads ? threads : 1]),
+      mStopping(false) {
+    for(std::size_t i = 0; i < mSize; ++i) {
+        if(!mThreads.get()[i].createNewThread(&UniThreadPool::work, this, options)) {
+            mSize = i;
+            shutdown();
+            throw UniException("Cannot start pool thread");
+        }
+    }
+}
+
+inline
+UniThreadPool::~UniThreadPool() {
+    shutdown();
+}
+
+template<typename F>
+UniFuture<typename UniTaskResult<F>::type> UniThreadPool::submit(const F &func) {
+    typedef typename UniTaskResult<F>::type R;
+    std::tr1::shared_ptr< priv::ValueState<R> > state(new priv::ValueState<R>());
+    push(new priv::FunctorTask<F, R>(func, state));
+    return UniFuture<R>(state);
+}
+
+template<typename R>
+UniFuture<R> UniThreadPool::submit(R (*func)()) {
+    std::tr1::shared_ptr< priv::ValueState<R> > state(new priv::ValueState<R>());
+    push(new priv::FunctorTask<R (*)(), R>(func, state));
+    return UniFuture<R>(state);
+}
+
+inline
+void UniThreadPool::push(priv::PoolTask *task) {
+    {
+        UniScopedLock lock(mMutex);
+        if(mStopping) {
+            delete task;
+            throw UniException("Thread pool is shut down");
+        }
+        mQueue.push_back(task);
+    }
+    mCondition.signal();
+}
+
+inline
+void UniThreadPool::shutdown() {
+    {
+        UniScopedLock lock(mMutex);
+        if(mStopping)
+            return;
+        mStopping = true;
+    }
+    mCondition.broadcast();
+    for(std::size_t i = 0; i < mSize; ++i)
+        mThreads.get()[i].join();
+}
+
+inline
+void *UniThreadPool::work(void *arg) {
+    UniThreadPool *pool = static_cast<UniThreadPool *>(arg);
+    for(;;) {
+        priv::PoolTask *task;
+        {
+            UniScopedLock lock(pool->mMutex);
+            while(pool->mQueue.empty() && !pool->mStopping)
+                pool->mCondition.wait(pool->mMutex);
+            if(pool->mQueue.empty())
+                break;
+            task = pool->mQueue.front();
+            pool->mQueue.pop_front();
+        }
+        task->run();
+        delete task;
+    }
+    return NULL;
+}
+
+}//namespace utils
+
+#endif
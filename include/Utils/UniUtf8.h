@@ -0,0 +1,326 @@
+// Copyright 2014  Michal Gluszek <mos.gluszek@gmail.com>
+//
+//  This file is part of UniCommon.
+//
+//  UniCommon is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  UniCommon is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
+#ifndef _UNI_UTF8_H
+#define _UNI_UTF8_H
+
+#include <cstddef>
+#include <wchar.h>
+
+//The vector paths are selected at compile time, build with -mavx2 to enable the AVX2 one
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define UNI_UTF8_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UNI_UTF8_SSE2
+#endif
+
+namespace utils {
+namespace utf8 {
+
+const wchar_t REPLACEMENT_CHAR = 0xFFFD;
+const int NO_DELIMITER = -1;
+
+namespace detail {
+
+inline bool is_cont(unsigned char c) {
+    return (c & 0xC0) == 0x80;
+}
+
+inline unsigned int first_bit(unsigned int mask) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return static_cast<unsigned int>(idx);
+#else
+    return static_cast<unsigned int>(__builtin_ctz(mask));
+#endif
+}
+
+#if defined(UNI_UTF8_AVX2) || defined(UNI_UTF8_SSE2)
+//Zero extends 16 ASCII bytes into dst
+inline void widen16(__m128i v, wchar_t *dst) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i *out = reinterpret_cast<__m128i *>(dst);
+    if(sizeof(wchar_t) == 4) {
+        _mm_storeu_si128(out, _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi, zero));
+    }
+    else {
+        _mm_storeu_si128(out, lo);
+        _mm_storeu_si128(out + 1, hi);
+    }
+}
+#endif
+
+//Copies the leading run of plain ASCII bytes which differ from delim into dst,
+//returns its length. The ASCII fast path of the decoder.
+inline std::size_t widen_run(const unsigned char *src, std::size_t len, int delim, wchar_t *dst) {
+    std::size_t i = 0;
+#if defined(UNI_UTF8_AVX2)
+    const __m256i d32 = _mm256_set1_epi8(static_cast<char>(delim));
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(v));
+        if(delim >= 0)
+            mask |= static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, d32)));
+        if(mask)
+            break;
+        if(sizeof(wchar_t) == 4) {
+            __m256i *out = reinterpret_cast<__m256i *>(dst + i);
+            _mm256_storeu_si256(out, _mm256_cvtepu8_epi32(_mm256_castsi256_si128(v)));
+            _mm256_storeu_si256(out + 1, _mm256_cvtepu8_epi32(_mm_srli_si128(_mm256_castsi256_si128(v), 8)));
+            _mm256_storeu_si256(out + 2, _mm256_cvtepu8_epi32(_mm256_extracti128_si256(v, 1)));
+            _mm256_storeu_si256(out + 3, _mm256_cvtepu8_epi32(_mm_srli_si128(_mm256_extracti128_si256(v, 1), 8)));
+        }
+        else {
+            widen16(_mm256_castsi256_si128(v), dst + i);
+            widen16(_mm256_extracti128_si256(v, 1), dst + i + 16);
+        }
+    }
+#endif
+#if defined(UNI_UTF8_AVX2) || defined(UNI_UTF8_SSE2)
+    const __m128i d16 = _mm_set1_epi8(static_cast<char>(delim));
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(v));
+        if(delim >= 0)
+            mask |= static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, d16)));
+        if(mask) {
+            std::size_t end = i + first_bit(mask);
+            for(; i < end; ++i)
+                dst[i] = static_cast<wchar_t>(src[i]);
+            return i;
+        }
+        widen16(v, dst + i);
+    }
+#endif
+    for(; i < len; ++i) {
+        if(src[i] >= 0x80 || static_cast<int>(src[i]) == delim)
+            break;
+        dst[i] = static_cast<wchar_t>(src[i]);
+    }
+    return i;
+}
+
+//Copies the leading run of wide characters below 0x80 into dst as bytes,
+//returns its length. The ASCII fast path of the encoder.
+inline std::size_t narrow_run(const wchar_t *src, std::size_t len, char *dst) {
+    std::size_t i = 0;
+#if defined(UNI_UTF8_AVX2) || defined(UNI_UTF8_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i high = (sizeof(wchar_t) == 4) ? _mm_set1_epi32(~0x7F) : _mm_set1_epi16(~0x7F);
+    for(; i + 16 <= len; i += 16) {
+        const __m128i *in = reinterpret_cast<const __m128i *>(src + i);
+        __m128i packed;
+        if(sizeof(wchar_t) == 4) {
+            __m128i a = _mm_loadu_si128(in), b = _mm_loadu_si128(in + 1);
+            __m128i c = _mm_loadu_si128(in + 2), d = _mm_loadu_si128(in + 3);
+            __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(any, high), zero)) != 0xFFFF)
+                break;
+            packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        }
+        else {
+            __m128i a = _mm_loadu_si128(in), b = _mm_loadu_si128(in + 1);
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_or_si128(a, b), high), zero)) != 0xFFFF)
+                break;
+            packed = _mm_packus_epi16(a, b);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), packed);
+    }
+#endif
+    for(; i < len; ++i) {
+        if(static_cast<unsigned long>(src[i]) >= 0x80)
+            break;
+        dst[i] = static_cast<char>(src[i]);
+    }
+    return i;
+}
+
+}//namespace detail
+
+//Decodes a single code point starting at src. Returns the number of bytes it takes,
+//or 0 when the sequence is cut by the end of data and final is not set.
+//Malformed input yields REPLACEMENT_CHAR, consumes the maximal invalid subpart and sets malformed.
+inline std::size_t decode_one(const char *src, std::size_t len, unsigned long &cp, bool &malformed, bool final) {
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(src);
+    malformed = false;
+    if(len == 0)
+        return 0;
+    unsigned char c = s[0];
+    if(c < 0x80) {
+        cp = c;
+        return 1;
+    }
+    std::size_t need;
+    unsigned char lo = 0x80, hi = 0xBF;
+    if(c >= 0xC2 && c <= 0xDF) {
+        need = 2;
+        cp = c & 0x1F;
+    }
+    else if(c >= 0xE0 && c <= 0xEF) {
+        need = 3;
+        cp = c & 0x0F;
+        if(c == 0xE0) lo = 0xA0;        //overlong
+        else if(c == 0xED) hi = 0x9F;   //surrogates
+    }
+    else if(c >= 0xF0 && c <= 0xF4) {
+        need = 4;
+        cp = c & 0x07;
+        if(c == 0xF0) lo = 0x90;        //overlong
+        else if(c == 0xF4) hi = 0x8F;   //above U+10FFFF
+    }
+    else {
+        cp = REPLACEMENT_CHAR;
+        malformed = true;
+        return 1;
+    }
+    for(std::size_t i = 1; i < need; ++i) {
+        if(i >= len) {
+            if(!final)
+                return 0;
+            cp = REPLACEMENT_CHAR;
+            malformed = true;
+            return i;
+        }
+        unsigned char b = s[i];
+        if(i == 1 ? (b < lo || b > hi) : !detail::is_cont(b)) {
+            cp = REPLACEMENT_CHAR;
+            malformed = true;
+            return i;
+        }
+        cp = (cp << 6) | (b & 0x3F);
+    }
+    return need;
+}
+
+//Number of wchar_t units needed to store the code point
+inline std::size_t wide_units(unsigned long cp) {
+    return (sizeof(wchar_t) == 2 && cp > 0xFFFF) ? 2 : 1;
+}
+
+//Stores the code point, as a surrogate pair where wchar_t is 16 bit wide
+inline std::size_t put_wide(unsigned long cp, wchar_t *dst) {
+    if(wide_units(cp) == 2) {
+        cp -= 0x10000;
+        dst[0] = static_cast<wchar_t>(0xD800 + (cp >> 10));
+        dst[1] = static_cast<wchar_t>(0xDC00 + (cp & 0x3FF));
+        return 2;
+    }
+    dst[0] = static_cast<wchar_t>(cp);
+    return 1;
+}
+
+//Decodes UTF-8 from [src, src + len) into dst. Stops when dstCount units were written,
+//when the delim byte is reached (it is neither consumed nor stored), or at the end of input.
+//A sequence cut by the end of input is left unconsumed unless final is set.
+//consumed receives the number of bytes used, malformed is increased by the number of
+//invalid sequences replaced with REPLACEMENT_CHAR. Returns the number of units written.
+inline std::size_t decode(const char *src, std::size_t len, wchar_t *dst, std::size_t dstCount,
+                          int delim, bool final, std::size_t &consumed, std::size_t &malformed) {
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(src);
+    std::size_t in = 0, out = 0;
+    while(in < len && out < dstCount) {
+        std::size_t room = len - in;
+        if(dstCount - out < room)
+            room = dstCount - out;
+        std::size_t run = detail::widen_run(s + in, room, delim, dst + out);
+        in += run;
+        out += run;
+        if(in == len || out == dstCount || static_cast<int>(s[in]) == delim)
+            break;
+
+        unsigned long cp;
+        bool bad;
+        std::size_t n = decode_one(src + in, len - in, cp, bad, final);
+        if(n == 0 || dstCount - out < wide_units(cp))
+            break;
+        out += put_wide(cp, dst + out);
+        in += n;
+        if(bad)
+            ++malformed;
+    }
+    consumed = in;
+    return out;
+}
+
+//Encodes a code point, returns the number of bytes written to dst (at most 4)
+inline std::size_t encode_one(unsigned long cp, char *dst) {
+    if(cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        cp = REPLACEMENT_CHAR;
+    if(cp < 0x80) {
+        dst[0] = static_cast<char>(cp);
+        return 1;
+    }
+    if(cp < 0x800) {
+        dst[0] = static_cast<char>(0xC0 | (cp >> 6));
+        dst[1] = static_cast<char>(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if(cp < 0x10000) {
+        dst[0] = static_cast<char>(0xE0 | (cp >> 12));
+        dst[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        dst[2] = static_cast<char>(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    dst[0] = static_cast<char>(0xF0 | (cp >> 18));
+    dst[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    dst[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    dst[3] = static_cast<char>(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+//Encodes [src, src + len) into at most dstLen bytes of dst, returns the number of bytes written.
+//consumed receives the number of wchar_t units used. Surrogate pairs of a 16 bit wchar_t are
+//joined, unpaired surrogates and invalid values are written as REPLACEMENT_CHAR.
+inline std::size_t encode(const wchar_t *src, std::size_t len, char *dst, std::size_t dstLen, std::size_t &consumed) {
+    std::size_t in = 0, out = 0;
+    while(in < len) {
+        std::size_t room = len - in;
+        if(dstLen - out < room)
+            room = dstLen - out;
+        std::size_t run = detail::narrow_run(src + in, room, dst + out);
+        in += run;
+        out += run;
+        if(in == len || dstLen - out < 4)
+            break;
+
+        unsigned long cp = static_cast<unsigned long>(src[in]) & (sizeof(wchar_t) == 2 ? 0xFFFF : 0xFFFFFFFF);
+        std::size_t units = 1;
+        if(sizeof(wchar_t) == 2 && cp >= 0xD800 && cp <= 0xDBFF && in + 1 < len) {
+            unsigned long low = static_cast<unsigned long>(src[in + 1]) & 0xFFFF;
+            if(low >= 0xDC00 && low <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                units = 2;
+            }
+        }
+        out += encode_one(cp, dst + out);
+        in += units;
+    }
+    consumed = in;
+    return out;
+}
+
+}//namespace utf8
+}//namespace utils
+
+#endif
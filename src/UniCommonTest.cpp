@@ -15,20 +15,764 @@
 //  You should have received a copy of the GNU General Public License
 //  along with UniCommon.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <cstdio>
+#include <cstddef>
+#include <stdexcept>
+//PROFILE_SCOPE records only with UNI_PROFILE
+#define UNI_PROFILE
 #include "UniCommon.h"
 
+std::string fileContent(const char *fileName) {
+    std::ifstream in(fileName, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+//Reads the whole file through read() in chunks of varying size, one of them above
+//the 4096 byte buffer so it bypasses it
+bool readsBack(const char *fileName, utils::UniFile::UFMode mode, const std::string &expected) {
+    static const std::size_t sizes[] = { 1, 7, 5000, 333, 4096, 13 };
+    utils::UniFile file(fileName, mode, 4096);
+    std::string got;
+    std::vector<char> chunk(5000);
+    for(std::size_t i = 0; ; ++i) {
+        std::size_t n = file.read(&chunk[0], sizes[i % 6]);
+        got.append(&chunk[0], n);
+        if(n < sizes[i % 6])
+            break;
+    }
+    return got == expected;
+}
+
+bool readsBack(const char *fileName, utils::UniFile::UFMode mode, const std::wstring &expected) {
+    static const std::size_t sizes[] = { 1, 7, 5000, 333, 4096, 13 };
+    utils::UniFile file(fileName, mode, 4096);
+    std::wstring got;
+    std::vector<wchar_t> chunk(5000);
+    for(std::size_t i = 0; ; ++i) {
+        std::size_t n = file.read(&chunk[0], sizes[i % 6]);
+        got.append(&chunk[0], n);
+        if(n < sizes[i % 6])
+            break;
+    }
+    return got == expected && file.malformed() == 0;
+}
+
+struct ChunkLineCounter {
+    std::vector<int> lines;
+    ChunkLineCounter(std::size_t chunks) : lines(chunks, 0) {}
+    void operator()(utils::UniFile &reader, const utils::UniFileChunk &chunk) {
+        utils::UniFile::line_view line;
+        while(reader.nextline(line))
+            ++lines[chunk.index];
+    }
+};
+
+struct Square {
+    typedef long result_type;
+    long x;
+    long operator()() const {
+        return x * x;
+    }
+};
+
+//Sums [from, to) by splitting it in halves until it is small
+struct RangeSum {
+    utils::UniTaskScheduler *scheduler;
+    long from;
+    long to;
+    long *result;
+    void operator()() const {
+        if(to - from <= 16) {
+            long sum = 0;
+            for(long i = from; i < to; ++i)
+                sum += i;
+            *result = sum;
+            return;
+        }
+        long mid = from + (to - from) / 2;
+        long left, right;
+        utils::UniTaskGroup group(*scheduler);
+        RangeSum first = { scheduler, from, mid, &left };
+        RangeSum second = { scheduler, mid, to, &right };
+        group.spawn(first);
+        second();
+        group.sync();
+        *result = left + right;
+    }
+};
+
+//Counts itself done after a millisecond, or throws
+struct SlowTask {
+    volatile long *done;
+    bool fail;
+    void operator()() const {
+        utils::sleep(1);
+        if(fail)
+            throw std::runtime_error("task error");
+        utils::UniAtomic::fetchAdd(done, 1L);
+    }
+};
+
+//Submitted to the pool as a plain function
+long fortyTwo() {
+    return 42;
+}
+
+struct LockedCounter {
+    LockedCounter() : count(0) {}
+    utils::UniAdaptiveMutex mutex;
+    long count;
+};
+
+//Adds 100000 to the counter, one locked increment at a time
+void *lockedIncrement(void *arg) {
+    LockedCounter *counter = static_cast<LockedCounter *>(arg);
+    for(int i = 0; i < 100000; ++i) {
+        utils::UniLockGuard<utils::UniAdaptiveMutex> lock(counter->mutex);
+        ++counter->count;
+    }
+    return NULL;
+}
+
+//Two values a writer keeps equal, readers count the times they saw them differ
+struct RWPair {
+    RWPair() : first(0), second(0), done(0), torn(0) {}
+    utils::UniRWLock lock;
+    long first;
+    long second;
+    volatile int done;
+    volatile long torn;
+};
+
+void *pairReader(void *arg) {
+    RWPair *pair = static_cast<RWPair *>(arg);
+    while(!utils::UniAtomic::load(&pair->done)) {
+        utils::UniSharedLock lock(pair->lock);
+        if(pair->first != pair->second)
+            utils::UniAtomic::fetchAdd(&pair->torn, 1L);
+    }
+    return NULL;
+}
+
+void *pairWriter(void *arg) {
+    RWPair *pair = static_cast<RWPair *>(arg);
+    for(int i = 0; i < 20000; ++i) {
+        utils::UniExclusiveLock lock(pair->lock);
+        ++pair->first;
+        ++pair->second;
+    }
+    utils::UniAtomic::store(&pair->done, 1);
+    return NULL;
+}
+
+//Reads back the name the thread was created with
+void *threadName(void *arg) {
+    std::string *name = static_cast<std::string *>(arg);
+#ifdef __linux__
+    char buffer[16] = "";
+    pthread_getname_np(pthread_self(), buffer, sizeof(buffer));
+    *name = buffer;
+#else
+    *name = "unitest";
+#endif
+    return NULL;
+}
+
+//Pushes 1..1000 and closes the queue
+void *queueProducer(void *arg) {
+    utils::UniBlockingQueue<long> *queue = static_cast<utils::UniBlockingQueue<long> *>(arg);
+    for(long i = 1; i <= 1000; ++i)
+        queue->push(i);
+    queue->close();
+    return NULL;
+}
+
+//Several producers and consumers on one queue
+struct SharedQueue {
+    explicit SharedQueue(std::size_t capacity) : queue(capacity), blocking(capacity), remaining(30000), sum(0) {}
+    utils::UniMPMCQueue<long> queue;
+    utils::UniBlockingQueue<long> blocking;
+    volatile long remaining;
+    volatile long sum;
+};
+
+//Pushes 1..10000, then into the blocking queue until it is closed, adding up what
+//went in there
+void *sharedProducer(void *arg) {
+    SharedQueue *shared = static_cast<SharedQueue *>(arg);
+    for(long i = 1; i <= 10000; ++i) {
+        while(!shared->queue.tryPush(i))
+            utils::UniAtomic::pause();
+    }
+    for(long i = 1; shared->blocking.push(i); ++i)
+        utils::UniAtomic::fetchAdd(&shared->sum, i);
+    return NULL;
+}
+
+//Pops until all 30000 values are taken, then drains the blocking queue, subtracting
+void *sharedConsumer(void *arg) {
+    SharedQueue *shared = static_cast<SharedQueue *>(arg);
+    long value;
+    while(utils::UniAtomic::load(&shared->remaining) > 0) {
+        if(shared->queue.tryPop(value)) {
+            utils::UniAtomic::fetchAdd(&shared->sum, value);
+            utils::UniAtomic::fetchAdd(&shared->remaining, -1L);
+        }
+    }
+    while(shared->blocking.pop(value))
+        utils::UniAtomic::fetchAdd(&shared->sum, -value);
+    return NULL;
+}
+
+//Pushes 1..1000 in batches of 10
+void *ringProducer(void *arg) {
+    utils::UniSPSCRing<long> *ring = static_cast<utils::UniSPSCRing<long> *>(arg);
+    long batch[10];
+    for(long i = 1; i <= 1000; i += 10) {
+        for(long k = 0; k < 10; ++k)
+            batch[k] = i + k;
+        for(std::size_t done = 0; done < 10; )
+            done += ring->pushBatch(batch + done, 10 - done);
+    }
+    return NULL;
+}
+
+//Ten nested profiled scopes
+void *profiledWork(void *) {
+    utils::UniProfiler::instance().setThreadName("profiled worker");
+    for(int i = 0; i < 10; ++i) {
+        PROFILE_SCOPE("outer");
+        utils::UniProfileScope inner("inner \"quoted\"");
+    }
+    return NULL;
+}
+
+struct TestConfig {
+    std::string name;
+    long value;
+    bool enabled;
+};
+
+struct TestLimits {
+    int small;
+    unsigned count;
+    unsigned long size;
+    float ratio;
+    double scale;
+};
+
 int main() {
 
     utils::UniSettings read("test.ini");
     std::string str = read.Get("Test", "name", "");
     int val = read.GetInteger("Test", "value", 100);
 
+    {
+        utils::UniSettings::Handle value = read.Resolve("test", "VALUE");
+        if(value.Valid() && read.GetInteger(value, 100) == val && !read.Resolve("Test", "none").Valid()) {
+            std::cout << "settings handle test ok" << std::endl;
+        }
+    }
+
+    {
+        std::string ini = "[Test]\nlong = " + std::string(1000, 'x') + " ; comment\n";
+        utils::UniSettings buffer(ini.data(), ini.size());
+        //Out of the long range, not clamped
+        std::string huge = "[Test]\nhuge = 99999999999999999999999\n";
+        utils::UniSettings overflow(huge.data(), huge.size());
+        if(buffer.ParseError() == 0 && buffer.Get("test", "long", "").size() == 1000 && overflow.GetInteger("Test", "huge", 7) == 7) {
+            std::cout << "settings buffer test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniSettings parsed("test.ini", "test.ini.img");
+        utils::UniSettings mapped("test.ini", "test.ini.img");
+        bool ok = !parsed.FromImage() && mapped.FromImage() && mapped.GetInteger("Test", "value", 100) == val;
+        //A damaged image is parsed again instead of mapped, first a value past the pool,
+        //then a slot past the entries
+        typedef utils::priv::CSettingsStore Store;
+        Store::ImageHeader header;
+        std::ifstream("test.ini.img", std::ios::binary).read(reinterpret_cast<char *>(&header), sizeof(header));
+        const std::streamoff damage[2] = {
+            static_cast<std::streamoff>(sizeof(header) + offsetof(Store::Entry, valOff)),
+            static_cast<std::streamoff>(sizeof(header) + header.entryCount * sizeof(Store::Entry))
+        };
+        for(int i = 0; i < 2; ++i) {
+            {
+                std::fstream image("test.ini.img", std::ios::in | std::ios::out | std::ios::binary);
+                uint32_t bad = header.poolSize + header.entryCount + 1;
+                image.seekp(damage[i]);
+                image.write(reinterpret_cast<const char *>(&bad), sizeof(bad));
+            }
+            utils::UniSettings damaged("test.ini", "test.ini.img");
+            ok = ok && !damaged.FromImage() && damaged.GetInteger("Test", "value", 100) == val;
+        }
+        if(ok) {
+            std::cout << "settings image test ok" << std::endl;
+        }
+        remove("test.ini.img");
+    }
+
+    {
+        std::ofstream("layer_test.ini") << "[test]\nvalue=2000\n";
+        std::vector<std::string> files;
+        files.push_back("test.ini");
+        files.push_back("layer_test.ini");
+        utils::UniSettings layered(files, 2);
+        if(layered.ParseError() == 0 && layered.GetInteger("Test", "value", 0) == 2000 && layered.Get("Test", "name", "") == str) {
+            std::cout << "layered settings test ok" << std::endl;
+        }
+        remove("layer_test.ini");
+    }
+
+    {
+        static const utils::UniSettingsSchema<TestConfig> schema = utils::UniSettingsSchema<TestConfig>()
+            .Field("Test", "name", &TestConfig::name, "")
+            .Field("Test", "value", &TestConfig::value, 100L)
+            .Field("Test", "enabled", &TestConfig::enabled, true, true);
+        TestConfig config;
+        utils::UniSettingsReport report = schema.Bind(read, config);
+        //Out of the field range, or negative for an unsigned field
+        std::string ini = "[Limits]\nsmall=-2147483649\ncount=-1\nsize=-5\nratio=1e300\nscale=1e400\n";
+        utils::UniSettings limitsIni(ini.data(), ini.size());
+        static const utils::UniSettingsSchema<TestLimits> limits = utils::UniSettingsSchema<TestLimits>()
+            .Field("Limits", "small", &TestLimits::small, 1)
+            .Field("Limits", "count", &TestLimits::count, 2u)
+            .Field("Limits", "size", &TestLimits::size, 3ul)
+            .Field("Limits", "ratio", &TestLimits::ratio, 4.0f)
+            .Field("Limits", "scale", &TestLimits::scale, 5.0);
+        TestLimits bound;
+        utils::UniSettingsReport limitsReport = limits.Bind(limitsIni, bound);
+        if(config.name == str && config.value == val && config.enabled && report.missing.size() == 1 &&
+           limitsReport.invalid.size() == 5 && bound.small == 1 && bound.count == 2 && bound.size == 3 && bound.ratio == 4.0f
+           && bound.scale == 5.0) {
+            std::cout << "settings schema test ok" << std::endl;
+        }
+    }
+
+    {
+        std::ofstream("live_test.ini") << "[Test]\nvalue=1\n";
+        utils::UniLiveSettings live("live_test.ini", false);
+        long before = utils::UniLiveSettings::Snapshot(live)->GetInteger("Test", "value", 0);
+        std::ofstream("live_test.ini") << "[Test]\nvalue=2\n";
+        bool ok = false;
+        if(live.reload()) {
+            utils::UniLiveSettings::Snapshot after(live);
+            ok = before == 1 && after.version() == 1 && after->GetInteger("Test", "value", 0) == 2;
+        }
+        //The watcher picks up a rewrite by itself
+        {
+            utils::UniLiveSettings watched("live_test.ini", true);
+            long value = 0;
+            for(int i = 0; i < 500 && value != 3; ++i) {
+                //Rewritten until seen, the watch may not be set up yet
+                if(i % 50 == 0)
+                    std::ofstream("live_test.ini") << "[Test]\nvalue=3\n";
+                utils::sleep(10);
+                value = utils::UniLiveSettings::Snapshot(watched)->GetInteger("Test", "value", 0);
+            }
+            ok = ok && value == 3 && utils::UniLiveSettings::Snapshot(watched).version() >= 1;
+        }
+        remove("live_test.ini");
+        if(ok) {
+            std::cout << "live settings test ok" << std::endl;
+        }
+    }
+
     {
         utils::UniFile utf8file("utf8.txt", utils::UniFile::UF_READ);
-        if(utf8file.is_open()) {
+        wchar_t line[64];
+        utf8file.getline(line, 64);
+        utf8file.getline(line, 64);
+        if(utf8file.is_open() && line[0] == 0x105 && utf8file.malformed() == 0) {
             std::cout << "utf8 test ok" << std::endl;
         }
     }
 
+    {
+        utils::UniFile mapped("test.ini", utils::UniFile::UF_READ_MAPPED);
+        char line[64];
+        mapped.getline(line, sizeof(line));
+        if(mapped.is_mapped() && std::string(line) == "[Test]") {
+            std::cout << "mapped test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniFile lines("test.ini", utils::UniFile::UF_READ);
+        int count = 0;
+        for(utils::UniFile::line_iterator it(lines), end; it != end; ++it)
+            ++count;
+        if(count == 3) {
+            std::cout << "line iterator test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniFile async("test.ini", utils::UniFile::UF_READ_ASYNC);
+        utils::UniFile::line_view line;
+        if(async.nextline(line) && std::string(line.data, line.size) == "[Test]") {
+            std::cout << "async read test ok" << std::endl;
+        }
+    }
+
+    {
+        {
+            utils::UniFile out("write_test.txt", utils::UniFile::UF_WRITE, 4096, utils::UniFile::UF_BOM);
+            out.write(L"\x105\n", 2);
+        }
+        bool ok;
+        {
+            utils::UniFile in("write_test.txt", utils::UniFile::UF_READ);
+            wchar_t c = 0;
+            in.get(c);
+            ok = in.is_widechar() && c == 0x105;
+        }
+        std::string big(5000, 'x');
+        std::string expected = "abc";
+        {
+            utils::UniFile out("write_test.txt", utils::UniFile::UF_WRITE, 4096);
+            out.write("abc", 3);
+            out.flush();
+            ok = ok && fileContent("write_test.txt") == expected;
+            //Larger than the buffer, goes out in one gathered write
+            utils::UniFile::line_view parts[3] = { { "<", 1 }, { big.data(), big.size() }, { ">", 1 } };
+            ok = ok && out.writev(parts, 3) == big.size() + 2;
+            expected += "<" + big + ">";
+        }
+        ok = ok && fileContent("write_test.txt") == expected;
+        {
+            utils::UniFile out("write_test.txt", utils::UniFile::UF_WRITE, 4096, utils::UniFile::UF_APPEND);
+            out.write("tail", 4);
+            expected += "tail";
+        }
+        ok = ok && fileContent("write_test.txt") == expected;
+        //Unaligned sizes in the direct mode, or the buffered one where the file system
+        //refuses O_DIRECT; appending reloads the partial last block
+        {
+            utils::UniFile out("write_test.txt", utils::UniFile::UF_WRITE, 4096, utils::UniFile::UF_DIRECT);
+            out.write(big.data(), 777);
+            out.write(big.data(), big.size());
+            out.flush();
+            ok = ok && fileContent("write_test.txt") == big.substr(0, 777) + big;
+            out.write("end", 3);
+        }
+        {
+            utils::UniFile out("write_test.txt", utils::UniFile::UF_WRITE, 4096, utils::UniFile::UF_DIRECT | utils::UniFile::UF_APPEND);
+            out.write("more", 4);
+        }
+        ok = ok && fileContent("write_test.txt") == big.substr(0, 777) + big + "endmore";
+        //Wide text encoded past the first block, the buffer fills up to a few bytes short
+        std::wstring wide;
+        for(int i = 0; i < 3000; ++i)
+            wide += (i % 3 == 2) ? wchar_t(0x20AC) : wchar_t(0x105);
+        {
+            utils::UniFile out("write_test.txt", utils::UniFile::UF_WRITE, 4096, utils::UniFile::UF_DIRECT | utils::UniFile::UF_BOM);
+            out.write(wide.data(), wide.size());
+        }
+        ok = ok && readsBack("write_test.txt", utils::UniFile::UF_READ, wide);
+        remove("write_test.txt");
+        if(ok) {
+            std::cout << "write test ok" << std::endl;
+        }
+    }
+
+    {
+        std::string bytes;
+        for(int i = 0; i < 20000; ++i)
+            bytes += static_cast<char>('a' + i % 26);
+        std::ofstream("bulk_test.txt", std::ios::binary) << bytes;
+        //After the BOM, 2 byte characters put a sequence across the 4096 byte boundary,
+        //3 byte ones across later ones
+        std::string utf8 = "\xEF\xBB\xBF";
+        std::wstring wide;
+        for(int i = 0; i < 6000; ++i) {
+            utf8 += (i % 3 == 2) ? "\xE2\x82\xAC" : "\xC4\x85";
+            wide += (i % 3 == 2) ? wchar_t(0x20AC) : wchar_t(0x105);
+        }
+        std::ofstream("bulk_utf8.txt", std::ios::binary) << utf8;
+        bool ok = true;
+        const utils::UniFile::UFMode modes[] = { utils::UniFile::UF_READ, utils::UniFile::UF_READ_MAPPED, utils::UniFile::UF_READ_ASYNC };
+        for(int i = 0; i < 3; ++i)
+            ok = ok && readsBack("bulk_test.txt", modes[i], bytes) && readsBack("bulk_utf8.txt", modes[i], wide);
+        remove("bulk_test.txt");
+        remove("bulk_utf8.txt");
+        if(ok) {
+            std::cout << "bulk read test ok" << std::endl;
+        }
+    }
+
+    {
+        ChunkLineCounter counter(2);
+        utils::UniFileChunks::scan("test.ini", 2, counter);
+        if(counter.lines[0] + counter.lines[1] == 3) {
+            std::cout << "chunk scan test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniAdaptiveMutex mutex;
+        bool first, second;
+        {
+            utils::UniLockGuard<utils::UniAdaptiveMutex> lock(mutex);
+            first = mutex.trylock();
+        }
+        second = mutex.trylock();
+        mutex.unlock();
+        LockedCounter counter;
+        utils::UniThread threads[4];
+        for(int i = 0; i < 4; ++i)
+            threads[i].createNewThread(&lockedIncrement, &counter);
+        for(int i = 0; i < 4; ++i)
+            threads[i].join();
+        if(!first && second && counter.count == 400000) {
+            std::cout << "adaptive mutex test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniRWLock rwlock;
+        bool writable, readable;
+        {
+            utils::UniSharedLock first(rwlock);
+            utils::UniSharedLock second(rwlock);
+            writable = rwlock.trylock();
+        }
+        {
+            utils::UniExclusiveLock exclusive(rwlock);
+            readable = rwlock.trylockShared();
+        }
+        RWPair pair;
+        utils::UniThread threads[4];
+        for(int i = 0; i < 3; ++i)
+            threads[i].createNewThread(&pairReader, &pair);
+        threads[3].createNewThread(&pairWriter, &pair);
+        for(int i = 0; i < 4; ++i)
+            threads[i].join();
+        if(!writable && !readable && pair.torn == 0 && pair.first == 20000 && rwlock.trylock()) {
+            rwlock.unlock();
+            std::cout << "rwlock test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniMutex named("self test");
+        bool counted;
+        {
+            utils::UniScopedLock lock(named);
+            counted = !named.trylock();
+        }
+        //Released again, the name changes nothing without the statistics
+        counted = counted && named.trylock();
+        named.unlock();
+#ifdef UNI_MUTEX_STATS
+        utils::UniLockCounters counters;
+        counted = utils::UniLockRegistry::instance().query("self test", counters) && counted && counters.acquisitions == 2;
+#endif
+        if(counted) {
+            std::cout << "named mutex test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniThreadPool pool(2);
+        std::vector< utils::UniFuture<long> > results;
+        for(long i = 1; i <= 10; ++i) {
+            Square task = { i };
+            results.push_back(pool.submit(task));
+        }
+        utils::UniFuture<long> function = pool.submit(fortyTwo);
+        utils::UniFuture<long> pointer = pool.submit(&fortyTwo);
+        long sum = 0;
+        for(std::size_t i = 0; i < results.size(); ++i)
+            sum += results[i].get();
+        sum += function.get() + pointer.get();
+        pool.shutdown();
+        if(sum == 385 + 84) {
+            std::cout << "thread pool test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniThreadOptions options;
+        options.name = "unitest";
+        options.stackSize = 256 * 1024;
+        options.cpus.push_back(0);
+        utils::UniThread thread;
+        std::string name;
+        if(thread.createNewThread(&threadName, &name, options)) {
+            thread.join();
+            if(name == "unitest") {
+                std::cout << "thread options test ok" << std::endl;
+            }
+        }
+    }
+
+    {
+        utils::UniTaskScheduler scheduler(2);
+        long sum = 0;
+        utils::UniTaskGroup group(scheduler);
+        RangeSum task = { &scheduler, 0, 10000, &sum };
+        group.spawn(task);
+        group.sync();
+        //This thread is not a worker, it waits while the tasks are still queued; the
+        //failure is rethrown once all of them finished
+        volatile long done = 0;
+        bool rethrown = false;
+        for(int i = 0; i < 20; ++i) {
+            SlowTask slow = { &done, i == 7 };
+            group.spawn(slow);
+        }
+        try {
+            group.sync();
+        }
+        catch (utils::UniException &e) {
+            rethrown = std::string(e.what()).find("task error") != std::string::npos;
+        }
+        group.sync();
+        if(sum == 49995000 && rethrown && done == 19) {
+            std::cout << "work stealing test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniBlockingQueue<long> queue(16);
+        utils::UniThread producer;
+        producer.createNewThread(&queueProducer, &queue);
+        long value, sum = 0;
+        while(queue.pop(value))
+            sum += value;
+        producer.join();
+        if(sum == 500500) {
+            std::cout << "blocking queue test ok" << std::endl;
+        }
+    }
+
+    {
+        //Three producers and three consumers; the blocking queue is closed while
+        //pushes are going on, every value pushed has to come out
+        SharedQueue shared(64);
+        utils::UniThread threads[6];
+        for(int i = 0; i < 3; ++i) {
+            threads[i].createNewThread(&sharedProducer, &shared);
+            threads[i + 3].createNewThread(&sharedConsumer, &shared);
+        }
+        while(utils::UniAtomic::load(&shared.remaining) > 0)
+            utils::sleep(1);
+        utils::sleep(5);
+        shared.blocking.close();
+        for(int i = 0; i < 6; ++i)
+            threads[i].join();
+        if(shared.sum == 3 * 50005000L && shared.queue.empty()) {
+            std::cout << "mpmc queue test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniSPSCRing<long> ring(16);
+        utils::UniThread producer;
+        producer.createNewThread(&ringProducer, &ring);
+        long values[8], sum = 0;
+        for(long count = 0; count < 1000; ) {
+            std::size_t n = ring.popBatch(values, 8);
+            for(std::size_t i = 0; i < n; ++i)
+                sum += values[i];
+            count += n;
+        }
+        producer.join();
+        //Created in plain memory by one object and attached by another, as two
+        //processes sharing a mapping would
+        std::vector<uint64_t> memory(utils::UniSPSCRing<long>::requiredSize(64) / 8 + 1);
+        utils::UniSPSCRing<long> creator(&memory[0], memory.size() * 8, true);
+        utils::UniSPSCRing<long> attached(&memory[0], memory.size() * 8, false);
+        long moved = 0;
+        bool shared = creator.tryPush(42) && attached.tryPop(moved) && moved == 42 && attached.capacity() == creator.capacity();
+        //Not a ring, then a ring whose capacity is not a power of two
+        std::vector<uint64_t> garbage(memory.size(), 0xABABABABABABABABull);
+        int rejected = 0;
+        for(int i = 0; i < 2; ++i) {
+            try {
+                utils::UniSPSCRing<long> bad(&garbage[0], garbage.size() * 8, false);
+            }
+            catch (utils::UniException &) {
+                ++rejected;
+            }
+            garbage = memory;
+            garbage[1] = 3;
+        }
+        if(sum == 500500 && ring.empty() && shared && rejected == 2) {
+            std::cout << "spsc ring test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::ApplicationTimer<utils::TSC_TIMER> timer;
+        timer.start();
+        utils::sleep(20);
+        timer.stop();
+        if(timer.value() > 0.015 && timer.value() < 1.0 && timer.valueTicks() > 0) {
+            std::cout << "tsc timer test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniHistogram first, second;
+        for(uint64_t i = 1; i <= 500; ++i) {
+            first.record(i);
+            second.record(i + 500);
+        }
+        first.merge(second);
+        utils::ApplicationTimer<utils::TSC_TIMER> timer;
+        timer.recordHistogram();
+        for(int i = 0; i < 100; ++i) {
+            timer.start();
+            timer.stop();
+        }
+        utils::TimerSummary summary = timer.summary();
+        uint64_t median = first.percentile(50.0);
+        if(first.count() == 1000 && median >= 495 && median <= 505 && first.percentile(100.0) == 1000
+                && summary.count == 100 && summary.p50 <= summary.p99 && summary.p99 <= summary.max) {
+            std::cout << "histogram test ok" << std::endl;
+        }
+    }
+
+    {
+        utils::UniThread worker;
+        worker.createNewThread(&profiledWork, (void *)NULL);
+        worker.join();
+        {
+            utils::UniProfileScope scope("main");
+        }
+        utils::UniProfiler &profiler = utils::UniProfiler::instance();
+        profiler.collect();
+        bool counted = profiler.size() == 21;
+        if(counted && profiler.writeTrace("trace_test.json")) {
+            std::ifstream trace("trace_test.json");
+            std::string text((std::istreambuf_iterator<char>(trace)), std::istreambuf_iterator<char>());
+            trace.close();
+            remove("trace_test.json");
+            counted = text.find("\"ph\":\"X\"") != std::string::npos && text.find("profiled worker") != std::string::npos
+                    && profiler.size() == 0;
+        }
+        //The background collector drains a second worker, which takes over the buffer
+        //the first one left
+        std::size_t buffers = profiler.buffers();
+        bool started = profiler.startCollector(1);
+        utils::UniThread second;
+        second.createNewThread(&profiledWork, (void *)NULL);
+        second.join();
+        for(int i = 0; i < 500 && profiler.size() < 20; ++i)
+            utils::sleep(10);
+        profiler.stopCollector();
+        if(counted && started && profiler.size() == 20 && profiler.buffers() == buffers && profiler.dropped() == 0) {
+            std::cout << "profiler test ok" << std::endl;
+        }
+        profiler.clear();
+    }
+
     return 0;
 };